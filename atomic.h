@@ -38,61 +38,2331 @@
 #  define _GNU_SOURCE
 #endif
 
+#if defined(ATOMIC_CYCLE_BUDGET) && !defined(ATOMIC_STATS)
+#  define ATOMIC_STATS 1
+#endif
+
 #include <stdint.h>
-#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(ATOMIC_STATS) || defined(ATOMIC_LATENCY)
+#  include <stdio.h>
+#  include <time.h>
+#endif
+
+#if defined(ATOMIC_SPIN_ADAPTIVE)
+#  include <time.h>
+#endif
+
+#if defined(ATOMIC_TRACE)
+#  include <stdio.h>
+#  include <time.h>
+#  include <signal.h>
+#endif
+
+#if defined(ATOMIC_USDT)
+#  if !defined(__has_include)
+#    include <sys/sdt.h>
+#    define __ATOMIC_USDT 1
+#  elif __has_include(<sys/sdt.h>)
+#    include <sys/sdt.h>
+#    define __ATOMIC_USDT 1
+#  elif !defined(ATOMIC_USDT_OPTIONAL)
+#    error "ATOMIC_USDT needs <sys/sdt.h>, define ATOMIC_USDT_OPTIONAL to build without the probes"
+#  endif
+#endif
+
+#if defined(ATOMIC_LOCK_FUTEX)
+#  include <linux/futex.h>
+#endif
+
+#if defined(ATOMIC_PSHARED)
+#  if defined(ATOMIC_SIM)
+#    error "ATOMIC_PSHARED needs real locks, it can't be combined with ATOMIC_SIM"
+#  endif
+#  include <errno.h>
+#  include <sched.h>
+#  include <stddef.h>
+#endif
+
+#if !defined(__DOXYGEN__)
+/* Internal helper functions. */
+
+#if defined(__i386__) || defined(__x86_64__)
+#  define __cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#  define __cpu_relax() __asm__ volatile ("yield" ::: "memory")
+#else
+#  define __cpu_relax() __asm__ volatile ("" ::: "memory")
+#endif
+
+#ifndef ATOMIC_DOMAINS
+#  define ATOMIC_DOMAINS 1
+#endif
+#if ATOMIC_DOMAINS < 1 || ATOMIC_DOMAINS > 8
+#  error "ATOMIC_DOMAINS has to be in the range 1..8"
+#endif
+
+/* The lock table can't use a range initializer (C++ doesn't know them),
+   so with more than one domain all 8 slots are initialized. */
+#if ATOMIC_DOMAINS > 1
+#  define __ATOMIC_LOCK_SLOTS 8
+#else
+#  define __ATOMIC_LOCK_SLOTS 1
+#endif
+
+#ifndef ATOMIC_SPIN_COUNT
+#  define ATOMIC_SPIN_COUNT 100
+#endif
+
+/* x86 prefetches cache lines in pairs and recent ARM cores have 128 byte
+   lines, so shared state written by different threads is kept 128 bytes
+   apart there. */
+#ifndef ATOMIC_CACHE_LINE
+#  if defined(__x86_64__) || defined(__aarch64__) || defined(__powerpc64__)
+#    define ATOMIC_CACHE_LINE 128
+#  else
+#    define ATOMIC_CACHE_LINE 64
+#  endif
+#endif
+#if ATOMIC_CACHE_LINE < 8 || ATOMIC_CACHE_LINE & (ATOMIC_CACHE_LINE - 1)
+#  error "ATOMIC_CACHE_LINE has to be a power of two of at least 8"
+#endif
+
+/* A type with this attribute gets its size rounded up to a whole line,
+   so no other data can end up next to it. */
+#define __ATOMIC_ALIGNED __attribute__((aligned(ATOMIC_CACHE_LINE)))
+
+__thread uint32_t __attribute__((weak)) _atomic_tid = 0;
+
+static __inline__ uint32_t __atomicTid(void)
+{
+	if(__builtin_expect(!_atomic_tid, 0))
+		_atomic_tid = (uint32_t)syscall(SYS_gettid);
+	return _atomic_tid;
+}
+
+#if !defined(ATOMIC_SIM)
+
+#if defined(ATOMIC_SPIN_ADAPTIVE)
+#ifndef ATOMIC_SPIN_MAX
+#  define ATOMIC_SPIN_MAX 10000
+#endif
+
+/* Written by the owner of the domain: when it got the lock and the
+   moving average of its hold times, both in __spinClock() units.
+   Waiters keep spinning while the current hold is still short compared
+   to that average; a hold running much longer means the owner does
+   something slow or got preempted, and then sleeping is cheaper. */
+struct _atomic_spin_t {
+	uint64_t since;
+	uint64_t avg;
+	uint32_t spinners;
+};
+
+#  define __ATOMIC_SPIN_INIT , { 0, 0, 0 }
+#else
+#  define __ATOMIC_SPIN_INIT
+#endif	/* ATOMIC_SPIN_ADAPTIVE */
+
+/* Everything a block entry touches, in a line of its own per domain:
+   the lock, the sequence count for ATOMIC_READ_BLOCK (odd while the
+   domain is held, only written by the owner) and the spinning state.
+
+   The futex owner holds the tid of the locking thread (0 when free) and
+   gets FUTEX_WAITERS or'ed in as soon as somebody sleeps on it. Nested
+   blocks never get here, so the lock needs no recursion count. */
+struct _atomic_lock_t {
+#if defined(ATOMIC_LOCK_FUTEX)
+	uint32_t owner;
+#else
+	pthread_mutex_t mutex;
+#endif
+	uint32_t seq;
+#if defined(ATOMIC_SPIN_ADAPTIVE)
+	struct _atomic_spin_t spin;
+#endif
+} __ATOMIC_ALIGNED;
+
+#if defined(ATOMIC_LOCK_FUTEX)
+#  define __ATOMIC_LOCK_INIT { 0, 0 __ATOMIC_SPIN_INIT }
+#else
+#  define __ATOMIC_LOCK_INIT { PTHREAD_MUTEX_INITIALIZER, 0 __ATOMIC_SPIN_INIT }
+#endif
+
+struct _atomic_lock_t __attribute__((weak)) _atomic_lock[__ATOMIC_LOCK_SLOTS] = {
+#if ATOMIC_DOMAINS > 1
+	__ATOMIC_LOCK_INIT, __ATOMIC_LOCK_INIT, __ATOMIC_LOCK_INIT, __ATOMIC_LOCK_INIT,
+	__ATOMIC_LOCK_INIT, __ATOMIC_LOCK_INIT, __ATOMIC_LOCK_INIT,
+#endif
+	__ATOMIC_LOCK_INIT
+};
+
+#if defined(ATOMIC_PSHARED)
+/* Every domain goes through a pointer, which atomic_pshared_attach()
+   moves into a segment shared with other processes. */
+struct _atomic_lock_t __attribute__((weak)) *_atomic_lock_of[__ATOMIC_LOCK_SLOTS] = {
+	&_atomic_lock[0],
+#if ATOMIC_DOMAINS > 1
+	&_atomic_lock[1], &_atomic_lock[2], &_atomic_lock[3],
+	&_atomic_lock[4], &_atomic_lock[5], &_atomic_lock[6], &_atomic_lock[7]
+#endif
+};
+
+#  define __ATOMIC_LOCK(domain) (*_atomic_lock_of[domain])
+#else
+#  define __ATOMIC_LOCK(domain) (_atomic_lock[domain])
+#endif	/* ATOMIC_PSHARED */
+
+#endif	/* !ATOMIC_SIM */
+
+#if defined(ATOMIC_SPIN_ADAPTIVE) && !defined(ATOMIC_SIM)
+
+uint32_t __attribute__((weak)) _atomic_spin_cpus = 0;
+
+static __inline__ uint64_t __spinClock(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static __inline__ void __spinAcquired(uint8_t domain)
+{
+	__atomic_store_n(&__ATOMIC_LOCK(domain).spin.since, __spinClock(), __ATOMIC_RELAXED);
+}
+
+static __inline__ void __spinReleased(uint8_t domain)
+{
+	struct _atomic_spin_t *spin = &__ATOMIC_LOCK(domain).spin;
+	int64_t hold = (int64_t)(__spinClock() - spin->since);
+	uint64_t avg = spin->avg;
+
+	__atomic_store_n(&spin->avg, avg + (uint64_t)((hold - (int64_t)avg) / 8), __ATOMIC_RELAXED);
+}
+
+/* Spinning only pays off while the owner can run, so there is no point
+   on a single CPU or with every other CPU spinning already. */
+static __inline__ uint8_t __spinBegin(uint8_t domain)
+{
+	uint32_t cpus = __atomic_load_n(&_atomic_spin_cpus, __ATOMIC_RELAXED);
+
+	if(__builtin_expect(!cpus, 0))
+	{
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		cpus = n > 0 ? (uint32_t)n : 1;
+		__atomic_store_n(&_atomic_spin_cpus, cpus, __ATOMIC_RELAXED);
+	}
+	if(__atomic_add_fetch(&__ATOMIC_LOCK(domain).spin.spinners, 1, __ATOMIC_RELAXED) < cpus)
+		return 1;
+	__atomic_sub_fetch(&__ATOMIC_LOCK(domain).spin.spinners, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static __inline__ uint8_t __spinMore(uint8_t domain, unsigned spins)
+{
+	const struct _atomic_spin_t *spin = &__ATOMIC_LOCK(domain).spin;
+	uint64_t held;
+
+	if(spins < ATOMIC_SPIN_COUNT)
+		return 1;
+	if(spins >= ATOMIC_SPIN_MAX)
+		return 0;
+	held = __spinClock() - __atomic_load_n(&spin->since, __ATOMIC_RELAXED);
+	return held < 2 * __atomic_load_n(&spin->avg, __ATOMIC_RELAXED);
+}
+
+static __inline__ void __spinEnd(uint8_t domain)
+{
+	__atomic_sub_fetch(&__ATOMIC_LOCK(domain).spin.spinners, 1, __ATOMIC_RELAXED);
+}
+
+#else	/* !ATOMIC_SPIN_ADAPTIVE */
+
+#define __spinAcquired(domain) ((void)(domain))
+#define __spinReleased(domain) ((void)(domain))
+
+#endif	/* ATOMIC_SPIN_ADAPTIVE */
+
+#if defined(ATOMIC_SIM)
+
+/* A single thread runs the program and calls the handlers itself, so
+   there is nothing to lock; the interrupt state is _atomic_mask alone.
+   The lock operations are still compiler barriers, like cli and sei. */
+static __inline__ void __atomicLock(uint8_t domain)
+{
+	(void)domain;
+	__asm__ volatile ("" ::: "memory");
+}
+
+static __inline__ uint8_t __atomicTryLock(uint8_t domain)
+{
+	(void)domain;
+	__asm__ volatile ("" ::: "memory");
+	return 1;
+}
+
+static __inline__ void __atomicUnlock(uint8_t domain)
+{
+	(void)domain;
+	__asm__ volatile ("" ::: "memory");
+}
+
+#elif defined(ATOMIC_LOCK_FUTEX)
+
+/* A private futex is keyed by the address in this process, a lock in a
+   shared segment needs the shared kind. */
+#if defined(ATOMIC_PSHARED)
+#  define __ATOMIC_FUTEX_PRIVATE 0
+#else
+#  define __ATOMIC_FUTEX_PRIVATE FUTEX_PRIVATE_FLAG
+#endif
+
+static __inline__ void __futexWait(uint32_t *word, uint32_t val)
+{
+	syscall(SYS_futex, word, FUTEX_WAIT | __ATOMIC_FUTEX_PRIVATE, val, NULL, NULL, 0);
+}
+
+static __inline__ void __futexWake(uint32_t *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE | __ATOMIC_FUTEX_PRIVATE, 1, NULL, NULL, 0);
+}
+
+#if defined(ATOMIC_SPIN_ADAPTIVE)
+#  define __futexSpinBegin(domain) __spinBegin(domain)
+#  define __futexSpinMore(domain, spins) __spinMore(domain, spins)
+#  define __futexSpinEnd(domain) __spinEnd(domain)
+#else
+#  define __futexSpinBegin(domain) ((void)(domain), 1)
+#  define __futexSpinMore(domain, spins) ((spins) < ATOMIC_SPIN_COUNT)
+#  define __futexSpinEnd(domain) ((void)(domain))
+#endif
+
+static __attribute__((noinline, unused)) void __atomicLockSlow(uint8_t domain, uint32_t tid)
+{
+	struct _atomic_lock_t *lock = &__ATOMIC_LOCK(domain);
+	uint32_t val;
+
+	if(__futexSpinBegin(domain))
+	{
+		for(unsigned spins = 0; __futexSpinMore(domain, spins); spins++)
+		{
+			val = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+			if(!val && __atomic_compare_exchange_n(&lock->owner, &val, tid,
+			                                       0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			{
+				__futexSpinEnd(domain);
+				return;
+			}
+			__cpu_relax();
+		}
+		__futexSpinEnd(domain);
+	}
+
+	/* Once we went to sleep we can't tell whether other sleepers are left,
+	   so keep FUTEX_WAITERS set and let the next unlock issue a wake. */
+	for(;;)
+	{
+		val = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+		if(!val)
+		{
+			if(__atomic_compare_exchange_n(&lock->owner, &val, tid | FUTEX_WAITERS,
+			                               0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+			continue;
+		}
+		if(!(val & FUTEX_WAITERS) &&
+		   !__atomic_compare_exchange_n(&lock->owner, &val, val | FUTEX_WAITERS,
+		                                0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+		__futexWait(&lock->owner, val | FUTEX_WAITERS);
+	}
+}
+
+static __inline__ void __atomicLock(uint8_t domain)
+{
+	struct _atomic_lock_t *lock = &__ATOMIC_LOCK(domain);
+	uint32_t tid = __atomicTid(), val = 0;
+
+	if(!__atomic_compare_exchange_n(&lock->owner, &val, tid,
+	                                0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		__atomicLockSlow(domain, tid);
+	__spinAcquired(domain);
+}
+
+static __inline__ uint8_t __atomicTryLock(uint8_t domain)
+{
+	struct _atomic_lock_t *lock = &__ATOMIC_LOCK(domain);
+	uint32_t tid = __atomicTid(), val = 0;
+
+	if(!__atomic_compare_exchange_n(&lock->owner, &val, tid,
+	                                0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+	__spinAcquired(domain);
+	return 1;
+}
+
+static __inline__ void __atomicUnlock(uint8_t domain)
+{
+	struct _atomic_lock_t *lock = &__ATOMIC_LOCK(domain);
+
+	__spinReleased(domain);
+	if(__atomic_exchange_n(&lock->owner, 0, __ATOMIC_RELEASE) & FUTEX_WAITERS)
+		__futexWake(&lock->owner);
+}
+
+#else	/* !ATOMIC_LOCK_FUTEX */
+
+#if defined(ATOMIC_PSHARED)
+/* The shared mutexes are robust: when a process dies inside a block,
+   the next one to lock the domain takes it over. The dead owner left
+   the sequence count odd, which would keep ATOMIC_READ_BLOCK readers
+   spinning and invert its parity for good, so it gets evened up. */
+static __attribute__((noinline, cold, unused)) int __atomicTakeOver(struct _atomic_lock_t *lock)
+{
+	uint32_t seq = __atomic_load_n(&lock->seq, __ATOMIC_RELAXED);
+
+	if(seq & 1)
+		__atomic_store_n(&lock->seq, seq + 1, __ATOMIC_RELEASE);
+	return pthread_mutex_consistent(&lock->mutex);
+}
+
+static __inline__ int __atomicMutexTrylock(struct _atomic_lock_t *lock)
+{
+	int err = pthread_mutex_trylock(&lock->mutex);
+
+	if(__builtin_expect(err == EOWNERDEAD, 0))
+		err = __atomicTakeOver(lock);
+	return err;
+}
+
+static __inline__ void __atomicMutexLock(struct _atomic_lock_t *lock)
+{
+	if(__builtin_expect(pthread_mutex_lock(&lock->mutex) == EOWNERDEAD, 0))
+		__atomicTakeOver(lock);
+}
+#else
+#  define __atomicMutexTrylock(lock) pthread_mutex_trylock(&(lock)->mutex)
+#  define __atomicMutexLock(lock) pthread_mutex_lock(&(lock)->mutex)
+#endif
+
+#if defined(ATOMIC_SPIN_ADAPTIVE)
+/* glibc's mutex goes to sleep almost right away, so the spinning is
+   done here, on trylock. */
+static __attribute__((noinline, unused)) void __atomicLockSlow(uint8_t domain)
+{
+	if(__spinBegin(domain))
+	{
+		for(unsigned spins = 0; __spinMore(domain, spins); spins++)
+		{
+			__cpu_relax();
+			if(!__atomicMutexTrylock(&__ATOMIC_LOCK(domain)))
+			{
+				__spinEnd(domain);
+				return;
+			}
+		}
+		__spinEnd(domain);
+	}
+	__atomicMutexLock(&__ATOMIC_LOCK(domain));
+}
+#endif	/* ATOMIC_SPIN_ADAPTIVE */
+
+static __inline__ void __atomicLock(uint8_t domain)
+{
+#if defined(ATOMIC_SPIN_ADAPTIVE)
+	if(__atomicMutexTrylock(&__ATOMIC_LOCK(domain)))
+		__atomicLockSlow(domain);
+#else
+	__atomicMutexLock(&__ATOMIC_LOCK(domain));
+#endif
+	__spinAcquired(domain);
+}
+
+static __inline__ uint8_t __atomicTryLock(uint8_t domain)
+{
+	if(__atomicMutexTrylock(&__ATOMIC_LOCK(domain)))
+		return 0;
+	__spinAcquired(domain);
+	return 1;
+}
+
+static __inline__ void __atomicUnlock(uint8_t domain)
+{
+	__spinReleased(domain);
+	pthread_mutex_unlock(&__ATOMIC_LOCK(domain).mutex);
+}
+
+#endif	/* ATOMIC_SIM, ATOMIC_LOCK_FUTEX */
+
+#if !defined(ATOMIC_SIM)
+static __inline__ void __seqWriteBegin(uint8_t domain)
+{
+	__atomic_store_n(&__ATOMIC_LOCK(domain).seq, __ATOMIC_LOCK(domain).seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static __inline__ void __seqWriteEnd(uint8_t domain)
+{
+	__atomic_store_n(&__ATOMIC_LOCK(domain).seq, __ATOMIC_LOCK(domain).seq + 1, __ATOMIC_RELEASE);
+}
+#else	/* ATOMIC_SIM */
+#define __seqWriteBegin(domain) ((void)(domain))
+#define __seqWriteEnd(domain) ((void)(domain))
+#endif	/* !ATOMIC_SIM */
+
+/* Call site of a block, only recorded with ATOMIC_STATS or
+   ATOMIC_LATENCY. */
+struct _atomic_site_t {
+	const char *file;
+	unsigned line;
+};
+
+#ifndef ATOMIC_EVENT_RING
+#  define ATOMIC_EVENT_RING 256
+#endif
+#if ATOMIC_EVENT_RING & (ATOMIC_EVENT_RING - 1)
+#  error "ATOMIC_EVENT_RING has to be a power of two"
+#endif
+
+#define __ATOMIC_EVENT_NESTED 1
+#define __ATOMIC_EVENT_LATENCY 2
+#define __ATOMIC_EVENT_BUDGET 3
+
+/* Bounded multi producer queue of rare events (misnested blocks, latency
+   violations) that must not be printed where they happen. Each cell
+   stores its sequence number minus its index, which lets the ring start
+   out zero initialized: a cell is free for position pos when
+   seq == pos & ~mask and filled when it is one more than that. */
+struct _atomic_event_t {
+	uint64_t seq;
+	const struct _atomic_site_t *site;
+	const void *where;
+	uint64_t value;
+	uint32_t tid;
+	uint8_t kind;
+};
+
+/* Producers and the draining thread each get a line of their own. */
+struct _atomic_events_t {
+	uint64_t head __ATOMIC_ALIGNED;
+	uint64_t dropped;
+	uint64_t tail __ATOMIC_ALIGNED;
+	struct _atomic_event_t ring[ATOMIC_EVENT_RING] __ATOMIC_ALIGNED;
+};
+
+struct _atomic_events_t __attribute__((weak)) _atomic_events;
+pthread_mutex_t __attribute__((weak)) _atomic_events_drain = PTHREAD_MUTEX_INITIALIZER;
+
+static __inline__ void __eventPush(uint8_t kind, const struct _atomic_site_t *site,
+                                   const void *where, uint64_t value)
+{
+	uint64_t pos = __atomic_load_n(&_atomic_events.head, __ATOMIC_RELAXED);
+	struct _atomic_event_t *cell;
+
+	for(;;)
+	{
+		uint64_t seq;
+
+		cell = &_atomic_events.ring[pos & (ATOMIC_EVENT_RING - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		if(seq == (pos & ~(uint64_t)(ATOMIC_EVENT_RING - 1)))
+		{
+			if(__atomic_compare_exchange_n(&_atomic_events.head, &pos, pos + 1,
+			                               1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(seq < (pos & ~(uint64_t)(ATOMIC_EVENT_RING - 1)))
+		{
+			__atomic_fetch_add(&_atomic_events.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else
+			pos = __atomic_load_n(&_atomic_events.head, __ATOMIC_RELAXED);
+	}
+	cell->kind = kind;
+	cell->site = site;
+	cell->where = where;
+	cell->value = value;
+	cell->tid = __atomicTid();
+	__atomic_store_n(&cell->seq, cell->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* The drain side formats by hand and uses write(), stdio would take its
+   own locks and isn't async signal safe anyway. */
+static __inline__ char *__eventString(char *p, const char *str)
+{
+	while(*str)
+		*p++ = *str++;
+	return p;
+}
+
+static __inline__ char *__eventNumber(char *p, uint64_t value, unsigned base)
+{
+	char digits[20];
+	unsigned n = 0;
+
+	do
+		digits[n++] = "0123456789abcdef"[value % base];
+	while(value /= base);
+	while(n)
+		*p++ = digits[--n];
+	return p;
+}
+
+static __inline__ void __eventWrite(int fd, const struct _atomic_event_t *event)
+{
+	char buf[512], *p = buf;
+
+	if(event->kind == __ATOMIC_EVENT_LATENCY)
+	{
+		p = __eventString(p, "atomic block held interrupts off for ");
+		p = __eventNumber(p, event->value, 10);
+		p = __eventString(p, " ns");
+	}
+	else if(event->kind == __ATOMIC_EVENT_BUDGET)
+	{
+		p = __eventString(p, "atomic block took an estimated ");
+		p = __eventNumber(p, event->value, 10);
+		p = __eventString(p, " AVR cycles");
+	}
+	else
+	{
+		p = __eventString(p, "you nested non recursive locks (held 0x");
+		p = __eventNumber(p, event->value, 16);
+		p = __eventString(p, ")");
+	}
+	p = __eventString(p, " tid ");
+	p = __eventNumber(p, event->tid, 10);
+	if(event->where)
+	{
+		p = __eventString(p, " at 0x");
+		p = __eventNumber(p, (uintptr_t)event->where, 16);
+	}
+	if(event->site && strlen(event->site->file) < sizeof(buf) - 128)
+	{
+		p = __eventString(p, " in ");
+		p = __eventString(p, event->site->file);
+		if(event->site->line)
+		{
+			*p++ = ':';
+			p = __eventNumber(p, event->site->line, 10);
+		}
+	}
+	*p++ = '\n';
+	if(write(fd, buf, p - buf) < 0)
+		return;
+}
+
+/* Writes the queued events to fd and frees their cells. */
+static __inline__ void atomic_diag_flush(int fd)
+{
+	uint64_t dropped;
+
+	pthread_mutex_lock(&_atomic_events_drain);
+	for(;;)
+	{
+		uint64_t pos = _atomic_events.tail;
+		struct _atomic_event_t *cell = &_atomic_events.ring[pos & (ATOMIC_EVENT_RING - 1)];
+
+		if(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != (pos & ~(uint64_t)(ATOMIC_EVENT_RING - 1)) + 1)
+			break;
+		__eventWrite(fd, cell);
+		_atomic_events.tail = pos + 1;
+		__atomic_store_n(&cell->seq, cell->seq - 1 + ATOMIC_EVENT_RING, __ATOMIC_RELEASE);
+	}
+	if((dropped = __atomic_exchange_n(&_atomic_events.dropped, 0, __ATOMIC_RELAXED)))
+	{
+		char buf[64], *p = buf;
+
+		p = __eventNumber(p, dropped, 10);
+		p = __eventString(p, " more atomic block events dropped\n");
+		if(write(fd, buf, p - buf) < 0)
+			dropped = 0;
+	}
+	pthread_mutex_unlock(&_atomic_events_drain);
+}
+
+pthread_once_t __attribute__((weak)) _atomic_diag_once = PTHREAD_ONCE_INIT;
+
+static __inline__ void __diagAtExit(void)
+{
+	atomic_diag_flush(2);
+}
+
+static __inline__ void __diagRegister(void)
+{
+	atexit(__diagAtExit);
+}
+
+/* Kept out of line, so the return address is the block that nested. */
+static __attribute__((noinline, cold, unused)) void __diagNested(const struct _atomic_site_t *site, uint8_t held)
+{
+	pthread_once(&_atomic_diag_once, __diagRegister);
+	__eventPush(__ATOMIC_EVENT_NESTED, site, __builtin_return_address(0), held);
+}
+
+#if defined(ATOMIC_STATS) || defined(ATOMIC_LATENCY)
+#define __ATOMIC_TRACK 1
+
+#define __ATOMIC_TRACK_BUCKETS 40
+
+#if defined(ATOMIC_STATS)
+
+#ifndef ATOMIC_STATS_SITES
+#  define ATOMIC_STATS_SITES 256
+#endif
+#if ATOMIC_STATS_SITES & (ATOMIC_STATS_SITES - 1)
+#  error "ATOMIC_STATS_SITES has to be a power of two"
+#endif
+
+/* Counters of one call site as seen by one thread. hold_hist[n] counts
+   holds of less than 2^(n + 1) ns. */
+struct _atomic_site_stats_t {
+	const struct _atomic_site_t *site;
+	uint64_t entries, acquired, contended;
+	uint64_t wait_ns, wait_max;
+	uint64_t hold_ns, hold_max;
+	uint64_t hold_hist[__ATOMIC_TRACK_BUCKETS];
+#if defined(ATOMIC_CYCLE_BUDGET)
+	uint64_t over;
+#endif
+};
+
+#if defined(ATOMIC_CYCLE_BUDGET)
+
+#ifndef ATOMIC_CYCLES_PER_US
+#  define ATOMIC_CYCLES_PER_US 500
+#endif
+
+uint64_t __attribute__((weak)) _atomic_cycles_per_us = ATOMIC_CYCLES_PER_US;
+uint64_t __attribute__((weak)) _atomic_cycles_floor = 0;
+uint64_t __attribute__((weak)) _atomic_cycles_exceeded = 0;
+
+/* AVR cycles a hold of ns host nanoseconds would take. The floor is
+   what measuring an empty hold costs on the host and has no AVR
+   counterpart. */
+static __inline__ uint64_t __cyclesEstimate(uint64_t ns)
+{
+	uint64_t floor = __atomic_load_n(&_atomic_cycles_floor, __ATOMIC_RELAXED);
+
+	return (ns > floor ? ns - floor : 0) * __atomic_load_n(&_atomic_cycles_per_us, __ATOMIC_RELAXED) / 1000;
+}
+
+/* Sets the scale from a reference that took host_ns on the host and
+   avr_cycles on the target. */
+static __inline__ void atomic_cycles_calibrate(uint64_t host_ns, uint64_t avr_cycles)
+{
+	if(host_ns)
+		__atomic_store_n(&_atomic_cycles_per_us, avr_cycles * 1000 / host_ns, __ATOMIC_RELAXED);
+}
+
+static __inline__ uint64_t atomic_cycles_exceeded(void)
+{
+	return __atomic_load_n(&_atomic_cycles_exceeded, __ATOMIC_RELAXED);
+}
+#endif	/* ATOMIC_CYCLE_BUDGET */
+#endif	/* ATOMIC_STATS */
+
+#if defined(ATOMIC_LATENCY)
+
+#ifndef ATOMIC_LATENCY_THRESHOLD_US
+#  define ATOMIC_LATENCY_THRESHOLD_US 100
+#endif
+
+/* Time with interrupts disabled, i.e. from taking the first lock to
+   dropping the last one. hist[n] as in _atomic_site_stats_t. */
+struct _atomic_latency_t {
+	uint64_t count, max;
+	const struct _atomic_site_t *max_site;
+	uint64_t hist[__ATOMIC_TRACK_BUCKETS];
+};
+#endif	/* ATOMIC_LATENCY */
+
+/* Allocated on the first block of a thread and never freed, so the report
+   at exit still sees threads that are long gone. Only its thread writes
+   it, so it is aligned like the shared lock state. */
+struct _atomic_thread_t {
+	struct _atomic_thread_t *next;
+	uint32_t tid;
+#if defined(ATOMIC_LATENCY)
+	struct _atomic_latency_t latency;
+#endif
+#if defined(ATOMIC_STATS)
+	struct _atomic_site_stats_t other;
+	struct _atomic_site_stats_t sites[ATOMIC_STATS_SITES];
+#endif
+} __ATOMIC_ALIGNED;
+
+struct _atomic_thread_t __attribute__((weak)) *_atomic_threads = NULL;
+pthread_once_t __attribute__((weak)) _atomic_track_once = PTHREAD_ONCE_INIT;
+
+__thread struct _atomic_thread_t __attribute__((weak)) *_atomic_thread = NULL;
+__thread uint8_t __attribute__((weak)) _atomic_held = 0;
+__thread uint64_t __attribute__((weak)) _atomic_hold_start = 0;
+__thread const struct _atomic_site_t __attribute__((weak)) *_atomic_hold_site = NULL;
+
+static __inline__ uint64_t __atomicNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static __inline__ unsigned __trackBucket(uint64_t ns)
+{
+	unsigned bucket = 63 - __builtin_clzll(ns | 1);
+
+	return bucket < __ATOMIC_TRACK_BUCKETS ? bucket : __ATOMIC_TRACK_BUCKETS - 1;
+}
+
+/* Upper bound of the histogram bucket the percentile falls into. */
+static __inline__ uint64_t __trackPercentile(const uint64_t *hist, uint64_t max, unsigned permille)
+{
+	uint64_t total = 0, sum = 0;
+
+	for(unsigned i = 0; i < __ATOMIC_TRACK_BUCKETS; i++)
+		total += hist[i];
+	for(unsigned i = 0; i < __ATOMIC_TRACK_BUCKETS; i++)
+		if((sum += hist[i]) * 1000 >= total * permille)
+			return ((uint64_t)2 << i) < max ? (uint64_t)2 << i : max;
+	return 0;
+}
+
+static __inline__ void __trackSiteName(char *buf, size_t size, const struct _atomic_site_t *site)
+{
+	if(!site)
+		snprintf(buf, size, "(other)");
+	else if(!site->line)
+		snprintf(buf, size, "%s", site->file);
+	else
+		snprintf(buf, size, "%s:%u", site->file, site->line);
+}
+
+void atomic_stats_report(FILE *out);
+void atomic_latency_report(FILE *out);
+
+static __inline__ void __trackAtExit(void)
+{
+#if defined(ATOMIC_STATS)
+	atomic_stats_report(stderr);
+#endif
+#if defined(ATOMIC_LATENCY)
+	atomic_latency_report(stderr);
+#endif
+}
+
+static __inline__ void __trackRegister(void)
+{
+#if defined(ATOMIC_CYCLE_BUDGET)
+	uint64_t floor = UINT64_MAX;
+
+	for(unsigned i = 0; i < 64; i++)
+	{
+		uint64_t start = __atomicNow(), end = __atomicNow();
+
+		if(end - start < floor)
+			floor = end - start;
+	}
+	__atomic_store_n(&_atomic_cycles_floor, floor, __ATOMIC_RELAXED);
+#endif
+	atexit(__trackAtExit);
+}
+
+static __attribute__((noinline, unused)) struct _atomic_thread_t *__trackThreadAlloc(void)
+{
+	void *mem;
+	struct _atomic_thread_t *thread;
+
+	if(posix_memalign(&mem, ATOMIC_CACHE_LINE, sizeof(*thread)))
+		abort();
+	thread = (struct _atomic_thread_t *)memset(mem, 0, sizeof(*thread));
+	thread->tid = __atomicTid();
+	pthread_once(&_atomic_track_once, __trackRegister);
+	thread->next = __atomic_load_n(&_atomic_threads, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&_atomic_threads, &thread->next, thread,
+	                                   1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return _atomic_thread = thread;
+}
+
+static __inline__ struct _atomic_thread_t *__trackThread(void)
+{
+	if(__builtin_expect(!_atomic_thread, 0))
+		return __trackThreadAlloc();
+	return _atomic_thread;
+}
+
+#if defined(ATOMIC_STATS)
+
+static __inline__ struct _atomic_site_stats_t *__statsEntry(const struct _atomic_site_t *site)
+{
+	struct _atomic_thread_t *thread = __trackThread();
+	uintptr_t hash = ((uintptr_t)site >> 3) * 0x9e3779b1u;
+
+	if(!site)
+		return &thread->other;
+	for(unsigned i = 0; i < ATOMIC_STATS_SITES; i++, hash++)
+	{
+		struct _atomic_site_stats_t *entry = &thread->sites[hash & (ATOMIC_STATS_SITES - 1)];
+
+		if(__builtin_expect(entry->site == site, 1))
+			return entry;
+		if(!entry->site)
+		{
+			entry->site = site;
+			return entry;
+		}
+	}
+	return &thread->other;
+}
+
+static __inline__ void __statsEnter(const struct _atomic_site_t *site)
+{
+	__statsEntry(site)->entries++;
+}
+
+static __inline__ void __statsAcquired(const struct _atomic_site_t *site, uint64_t now, uint64_t wait)
+{
+	struct _atomic_site_stats_t *entry = __statsEntry(site);
+
+	entry->acquired++;
+	if(wait)
+	{
+		entry->contended++;
+		entry->wait_ns += now - wait;
+		if(now - wait > entry->wait_max)
+			entry->wait_max = now - wait;
+	}
+}
+
+static __inline__ void __statsReleased(const struct _atomic_site_t *site, uint64_t hold)
+{
+	struct _atomic_site_stats_t *entry = __statsEntry(site);
+
+	entry->hold_ns += hold;
+	if(hold > entry->hold_max)
+		entry->hold_max = hold;
+	entry->hold_hist[__trackBucket(hold)]++;
+#if defined(ATOMIC_CYCLE_BUDGET)
+	if(__builtin_expect(__cyclesEstimate(hold) > ATOMIC_CYCLE_BUDGET, 0))
+	{
+		__atomic_fetch_add(&_atomic_cycles_exceeded, 1, __ATOMIC_RELAXED);
+		if(!entry->over++)
+			__eventPush(__ATOMIC_EVENT_BUDGET, site, NULL, __cyclesEstimate(hold));
+	}
+#endif
+}
+
+/* Blocks in inline functions have one site per translation unit, so
+   sites are merged by file and line rather than by address. */
+static __inline__ int __statsCompareSite(const void *a, const void *b)
+{
+	const struct _atomic_site_t *x = ((const struct _atomic_site_stats_t *)a)->site;
+	const struct _atomic_site_t *y = ((const struct _atomic_site_stats_t *)b)->site;
+	int diff;
+
+	if(!x || !y)
+		return !x - !y;
+	if((diff = strcmp(x->file, y->file)))
+		return diff;
+	return (x->line > y->line) - (x->line < y->line);
+}
+
+static __inline__ int __statsCompareHold(const void *a, const void *b)
+{
+	uint64_t x = ((const struct _atomic_site_stats_t *)a)->hold_ns;
+	uint64_t y = ((const struct _atomic_site_stats_t *)b)->hold_ns;
+
+	return (x < y) - (x > y);
+}
+
+static __inline__ uint64_t __statsHolds(const struct _atomic_site_stats_t *entry)
+{
+	uint64_t total = 0;
+
+	for(unsigned i = 0; i < __ATOMIC_TRACK_BUCKETS; i++)
+		total += entry->hold_hist[i];
+	return total;
+}
+
+static __inline__ void __statsMerge(struct _atomic_site_stats_t *into, const struct _atomic_site_stats_t *from)
+{
+	into->entries += from->entries;
+	into->acquired += from->acquired;
+	into->contended += from->contended;
+	into->wait_ns += from->wait_ns;
+	into->hold_ns += from->hold_ns;
+	if(from->wait_max > into->wait_max)
+		into->wait_max = from->wait_max;
+	if(from->hold_max > into->hold_max)
+		into->hold_max = from->hold_max;
+	for(unsigned i = 0; i < __ATOMIC_TRACK_BUCKETS; i++)
+		into->hold_hist[i] += from->hold_hist[i];
+#if defined(ATOMIC_CYCLE_BUDGET)
+	into->over += from->over;
+#endif
+}
+
+/* Threads still running while the report is made may show slightly
+   inconsistent numbers. */
+void __attribute__((weak)) atomic_stats_report(FILE *out)
+{
+	struct _atomic_thread_t *thread, *first = __atomic_load_n(&_atomic_threads, __ATOMIC_ACQUIRE);
+	struct _atomic_site_stats_t *all;
+	size_t count = 0, merged = 0;
+
+	for(thread = first; thread; thread = thread->next)
+		count += ATOMIC_STATS_SITES + 1;
+	if(!count || !(all = (struct _atomic_site_stats_t *)malloc(count * sizeof(*all))))
+		return;
+	count = 0;
+	for(thread = first; thread; thread = thread->next)
+	{
+		for(unsigned i = 0; i < ATOMIC_STATS_SITES; i++)
+			if(thread->sites[i].site)
+				all[count++] = thread->sites[i];
+		if(thread->other.entries || thread->other.acquired)
+			all[count++] = thread->other;
+	}
+	qsort(all, count, sizeof(*all), __statsCompareSite);
+	for(size_t i = 0; i < count; i++)
+	{
+		if(merged && !__statsCompareSite(&all[merged - 1], &all[i]))
+			__statsMerge(&all[merged - 1], &all[i]);
+		else
+			all[merged++] = all[i];
+	}
+	qsort(all, merged, sizeof(*all), __statsCompareHold);
+
+	fprintf(out, "atomic block statistics, %zu sites by total hold time (ns):\n", merged);
+	fprintf(out, "%-32s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "site", "entries", "acquired",
+	        "contended", "wait avg", "wait max", "hold avg", "hold p50", "hold p99", "hold max");
+	for(size_t i = 0; i < merged; i++)
+	{
+		const struct _atomic_site_stats_t *entry = &all[i];
+		uint64_t holds = __statsHolds(entry);
+		char site[256];
+
+		__trackSiteName(site, sizeof(site), entry->site);
+		fprintf(out, "%-32s %10llu %10llu %10llu %10llu %10llu %10llu %10llu %10llu %10llu\n", site,
+		        (unsigned long long)entry->entries, (unsigned long long)entry->acquired,
+		        (unsigned long long)entry->contended,
+		        (unsigned long long)(entry->contended ? entry->wait_ns / entry->contended : 0),
+		        (unsigned long long)entry->wait_max,
+		        (unsigned long long)(holds ? entry->hold_ns / holds : 0),
+		        (unsigned long long)__trackPercentile(entry->hold_hist, entry->hold_max, 500),
+		        (unsigned long long)__trackPercentile(entry->hold_hist, entry->hold_max, 990),
+		        (unsigned long long)entry->hold_max);
+	}
+#if defined(ATOMIC_CYCLE_BUDGET)
+	fprintf(out, "estimated AVR cycles at %llu per host us (minus %llu ns), budget %llu:\n",
+	        (unsigned long long)__atomic_load_n(&_atomic_cycles_per_us, __ATOMIC_RELAXED),
+	        (unsigned long long)__atomic_load_n(&_atomic_cycles_floor, __ATOMIC_RELAXED),
+	        (unsigned long long)ATOMIC_CYCLE_BUDGET);
+	fprintf(out, "%-32s %10s %10s %10s %10s\n", "site", "cyc p50", "cyc p99", "cyc max", "over");
+	for(size_t i = 0; i < merged; i++)
+	{
+		const struct _atomic_site_stats_t *entry = &all[i];
+		char site[256];
+
+		if(!__statsHolds(entry))
+			continue;
+		__trackSiteName(site, sizeof(site), entry->site);
+		fprintf(out, "%-32s %10llu %10llu %10llu %10llu%s\n", site,
+		        (unsigned long long)__cyclesEstimate(__trackPercentile(entry->hold_hist, entry->hold_max, 500)),
+		        (unsigned long long)__cyclesEstimate(__trackPercentile(entry->hold_hist, entry->hold_max, 990)),
+		        (unsigned long long)__cyclesEstimate(entry->hold_max),
+		        (unsigned long long)entry->over, entry->over ? " OVER BUDGET" : "");
+	}
+	fflush(out);
+	atomic_diag_flush(fileno(out));
+#endif
+	free(all);
+}
+
+#else	/* !ATOMIC_STATS */
+
+#define __statsEnter(site) ((void)(site))
+#define __statsAcquired(site, now, wait) ((void)(site), (void)(now), (void)(wait))
+#define __statsReleased(site, hold) ((void)(site), (void)(hold))
+
+#endif	/* ATOMIC_STATS */
+
+#if defined(ATOMIC_LATENCY)
+
+uint64_t __attribute__((weak)) _atomic_latency_threshold = (uint64_t)ATOMIC_LATENCY_THRESHOLD_US * 1000;
+uint64_t __attribute__((weak)) _atomic_latency_exceeded = 0;
+
+static __inline__ void __latencyRecord(const struct _atomic_site_t *site, uint64_t hold)
+{
+	struct _atomic_latency_t *latency = &__trackThread()->latency;
+
+	latency->count++;
+	latency->hist[__trackBucket(hold)]++;
+	if(hold > latency->max)
+	{
+		latency->max = hold;
+		latency->max_site = site;
+	}
+	if(__builtin_expect(hold > __atomic_load_n(&_atomic_latency_threshold, __ATOMIC_RELAXED), 0))
+	{
+		__atomic_fetch_add(&_atomic_latency_exceeded, 1, __ATOMIC_RELAXED);
+		__eventPush(__ATOMIC_EVENT_LATENCY, site, NULL, hold);
+	}
+}
+
+static __inline__ void atomic_latency_set_threshold(uint64_t us)
+{
+	__atomic_store_n(&_atomic_latency_threshold, us * 1000, __ATOMIC_RELAXED);
+}
+
+static __inline__ uint64_t atomic_latency_exceeded(void)
+{
+	return __atomic_load_n(&_atomic_latency_exceeded, __ATOMIC_RELAXED);
+}
+
+void __attribute__((weak)) atomic_latency_report(FILE *out)
+{
+	struct _atomic_latency_t total;
+	uint32_t max_tid = 0;
+	char site[256];
+
+	__builtin_memset(&total, 0, sizeof(total));
+	for(struct _atomic_thread_t *thread = __atomic_load_n(&_atomic_threads, __ATOMIC_ACQUIRE);
+	    thread; thread = thread->next)
+	{
+		total.count += thread->latency.count;
+		for(unsigned i = 0; i < __ATOMIC_TRACK_BUCKETS; i++)
+			total.hist[i] += thread->latency.hist[i];
+		if(thread->latency.max > total.max)
+		{
+			total.max = thread->latency.max;
+			total.max_site = thread->latency.max_site;
+			max_tid = thread->tid;
+		}
+	}
+	if(!total.count)
+		return;
+
+	__trackSiteName(site, sizeof(site), total.max_site);
+	fprintf(out, "atomic block latency over %llu intervals with interrupts off:\n"
+	             "  p50 <= %llu ns, p99 <= %llu ns, p99.9 <= %llu ns, max %llu ns at %s (tid %u)\n",
+	        (unsigned long long)total.count,
+	        (unsigned long long)__trackPercentile(total.hist, total.max, 500),
+	        (unsigned long long)__trackPercentile(total.hist, total.max, 990),
+	        (unsigned long long)__trackPercentile(total.hist, total.max, 999),
+	        (unsigned long long)total.max, site, max_tid);
+	fprintf(out, "  %llu intervals exceeded %llu ns\n",
+	        (unsigned long long)__atomic_load_n(&_atomic_latency_exceeded, __ATOMIC_RELAXED),
+	        (unsigned long long)__atomic_load_n(&_atomic_latency_threshold, __ATOMIC_RELAXED));
+	fflush(out);
+	atomic_diag_flush(fileno(out));
+}
+
+#else	/* !ATOMIC_LATENCY */
+
+#define __latencyRecord(site, hold) ((void)(site), (void)(hold))
+
+#endif	/* ATOMIC_LATENCY */
+#endif	/* __ATOMIC_TRACK */
+
+#if defined(__ATOMIC_TRACK) || defined(ATOMIC_USDT) || defined(ATOMIC_TRACE) || defined(ATOMIC_LOCK_ORDER)
+#define __ATOMIC_SITES 1
+
+#define __ATOMIC_TRACK_STACK 16
+
+#if !defined(__ATOMIC_TRACK)
+#define __statsEnter(site) ((void)(site))
+#endif
+
+__thread const struct _atomic_site_t __attribute__((weak)) *_atomic_site_stack[__ATOMIC_TRACK_STACK];
+__thread uint8_t __attribute__((weak)) _atomic_site_depth = 0;
+
+/* Every block pushes its call site on entry and pops it on exit, so locks
+   taken from inside the helpers (NONATOMIC_BLOCK exit, isr_enter()) are
+   accounted to the right site. */
+static __inline__ void __trackPush(const struct _atomic_site_t *site)
+{
+	__statsEnter(site);
+	if(_atomic_site_depth < __ATOMIC_TRACK_STACK)
+		_atomic_site_stack[_atomic_site_depth] = site;
+	_atomic_site_depth++;
+}
+
+static __inline__ void __trackPop(void)
+{
+	_atomic_site_depth--;
+}
+
+static __inline__ const struct _atomic_site_t *__trackTop(void)
+{
+	uint8_t depth = _atomic_site_depth;
+
+	if(!depth)
+		return NULL;
+	if(depth > __ATOMIC_TRACK_STACK)
+		depth = __ATOMIC_TRACK_STACK;
+	return _atomic_site_stack[depth - 1];
+}
+
+/* Replaces the innermost call site, for lock operations done on behalf
+   of an enclosing block. Returns what to put back. */
+static __inline__ const struct _atomic_site_t *__trackSwap(const struct _atomic_site_t *site)
+{
+	const struct _atomic_site_t *prev;
+	uint8_t depth = _atomic_site_depth;
+
+	if(!depth || depth > __ATOMIC_TRACK_STACK)
+		return site;
+	prev = _atomic_site_stack[depth - 1];
+	_atomic_site_stack[depth - 1] = site;
+	return prev;
+}
+
+#define __ATOMIC_SITE() ({ static const struct _atomic_site_t __site = { __FILE__, __LINE__ }; &__site; })
+#define __ATOMIC_SITE_PUSH() __trackPush(__ATOMIC_SITE())
+
+#else	/* !__ATOMIC_SITES */
+
+#define __trackPop() ((void)0)
+#define __trackTop() ((const struct _atomic_site_t *)NULL)
+#define __trackSwap(site) (site)
+#define __ATOMIC_SITE_PUSH() ((void)0)
+
+#endif	/* __ATOMIC_SITES */
+
+#if defined(__ATOMIC_USDT)
+/* Static probe of provider "atomic". The arguments are file and line of
+   the innermost block (NULL and 0 for the C++ guards), the nesting depth of
+   blocks, the domains held before and the domains that change. A probe
+   is a single nop until a tracer attaches. */
+#define __atomicProbe(name, held, domains) do { \
+	const struct _atomic_site_t *__probe_site = __trackTop(); \
+	DTRACE_PROBE5(atomic, name, __probe_site ? __probe_site->file : NULL, \
+	              __probe_site ? __probe_site->line : 0u, _atomic_site_depth, held, domains); \
+} while(0)
+#else
+#define __atomicProbe(name, held, domains) ((void)(held), (void)(domains))
+#endif
+
+#if defined(__ATOMIC_TRACK)
+static __inline__ void __trackLock(uint8_t domain, uint64_t *wait)
+{
+#if defined(ATOMIC_STATS)
+	if(__atomicTryLock(domain))
+		return;
+	if(!*wait)
+		*wait = __atomicNow();
+#else
+	(void)wait;
+#endif
+	__atomicLock(domain);
+}
+
+static __inline__ void __trackAcquired(uint8_t took, uint64_t wait)
+{
+	const struct _atomic_site_t *site;
+	uint64_t now;
+
+	if(!took)
+		return;
+	now = __atomicNow();
+	site = __trackTop();
+	__statsAcquired(site, now, wait);
+	if(!_atomic_held)
+	{
+		_atomic_hold_start = now;
+		_atomic_hold_site = site;
+	}
+	_atomic_held += took;
+}
+
+static __inline__ void __trackReleased(uint8_t released)
+{
+	uint64_t hold;
+
+	if(!released || (_atomic_held -= released))
+		return;
+	hold = __atomicNow() - _atomic_hold_start;
+	__statsReleased(_atomic_hold_site, hold);
+	__latencyRecord(_atomic_hold_site, hold);
+}
+
+#else	/* !__ATOMIC_TRACK */
+
+#define __trackLock(domain, wait) __atomicLock(domain)
+#define __trackAcquired(took, wait) ((void)(took), (void)(wait))
+#define __trackReleased(released) ((void)(released))
+
+#endif	/* __ATOMIC_TRACK */
+
+/* Emulated interrupt state of the calling thread, i.e. the inverted I bit
+   of SREG: bit n is set while the thread holds domain n. Being thread
+   local it costs no shared memory traffic and is valid without holding
+   the lock, so a block that finds interrupts already off leaves the lock
+   alone. */
+__thread uint8_t __attribute__((weak)) _atomic_mask = 0;
+
+#define __ATOMIC_ALL ((uint8_t)((1u << ATOMIC_DOMAINS) - 1))
+
+/* Without domains configured any domain means the whole lock. */
+#if ATOMIC_DOMAINS > 1
+#  define __ATOMIC_DOMAIN(domain) ((uint8_t)(1u << (domain)))
+#else
+#  define __ATOMIC_DOMAIN(domain) ((void)(domain), __ATOMIC_ALL)
+#endif
+
+#if defined(ATOMIC_PSHARED)
+
+#define __ATOMIC_PSHARED_READY 2u
+
+/* The lock state of all domains, to be placed in memory every process
+   maps. Processes built with other lock options must not share one, so
+   the layout is checked on attach. */
+struct _atomic_pshared_t {
+	uint32_t state;	/* 0 zero filled, 1 being set up, 2 ready */
+	uint32_t layout;
+	struct _atomic_lock_t lock[__ATOMIC_LOCK_SLOTS];
+};
+
+#define ATOMIC_PSHARED_SIZE sizeof(struct _atomic_pshared_t)
+
+/* sizeof(struct _atomic_lock_t) is padded to a line whatever is in it,
+   so the layout word is made of the lock options, the end of the
+   actual fields and the stride of the slots. */
+#if defined(ATOMIC_LOCK_FUTEX)
+#  define __ATOMIC_PSHARED_FUTEX 0x10u
+#else
+#  define __ATOMIC_PSHARED_FUTEX 0
+#endif
+#if defined(ATOMIC_SPIN_ADAPTIVE)
+#  define __ATOMIC_PSHARED_SPIN 0x20u
+#  define __ATOMIC_PSHARED_END (offsetof(struct _atomic_lock_t, spin) + sizeof(struct _atomic_spin_t))
+#else
+#  define __ATOMIC_PSHARED_SPIN 0
+#  define __ATOMIC_PSHARED_END (offsetof(struct _atomic_lock_t, seq) + sizeof(uint32_t))
+#endif
+
+#define __ATOMIC_PSHARED_LAYOUT ((uint32_t)ATOMIC_DOMAINS | __ATOMIC_PSHARED_FUTEX | __ATOMIC_PSHARED_SPIN | \
+                                 (uint32_t)offsetof(struct _atomic_lock_t, seq) << 8 | \
+                                 (uint32_t)__ATOMIC_PSHARED_END << 16 | \
+                                 (uint32_t)__builtin_ctz(sizeof(struct _atomic_lock_t)) << 24)
+
+static __inline__ int __psharedSetup(struct _atomic_pshared_t *shared)
+{
+#if defined(ATOMIC_LOCK_FUTEX)
+	(void)shared;
+	return 0;
+#else
+	pthread_mutexattr_t attr;
+	int err;
+
+	if((err = pthread_mutexattr_init(&attr)))
+		return err;
+	if(!(err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)) &&
+	   !(err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)))
+	{
+		for(unsigned slot = 0; slot < __ATOMIC_LOCK_SLOTS && !err; slot++)
+			err = pthread_mutex_init(&shared->lock[slot].mutex, &attr);
+	}
+	pthread_mutexattr_destroy(&attr);
+	return err;
+#endif
+}
+
+/* Moves the domains in mask into the shared segment. The first process to
+   attach sets the segment up, the others wait for it. */
+static __inline__ int atomic_pshared_attach(void *segment, uint8_t domains)
+{
+	struct _atomic_pshared_t *shared = (struct _atomic_pshared_t *)segment;
+	uint32_t state = 0;
+	int err;
+
+	if(((uintptr_t)segment & (ATOMIC_CACHE_LINE - 1)) || (domains & ~__ATOMIC_ALL))
+		return EINVAL;
+	if(_atomic_mask)
+		return EBUSY;
+	if(__atomic_compare_exchange_n(&shared->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+	{
+		if((err = __psharedSetup(shared)))
+		{
+			__atomic_store_n(&shared->state, 0, __ATOMIC_RELEASE);
+			return err;
+		}
+		shared->layout = __ATOMIC_PSHARED_LAYOUT;
+		__atomic_store_n(&shared->state, __ATOMIC_PSHARED_READY, __ATOMIC_RELEASE);
+	}
+	while(__atomic_load_n(&shared->state, __ATOMIC_ACQUIRE) != __ATOMIC_PSHARED_READY)
+		sched_yield();
+	if(shared->layout != __ATOMIC_PSHARED_LAYOUT)
+		return EINVAL;
+	for(uint8_t domain = 0; domain < ATOMIC_DOMAINS; domain++)
+		if(domains & (1u << domain))
+			__atomic_store_n(&_atomic_lock_of[domain], &shared->lock[domain], __ATOMIC_RELEASE);
+	return 0;
+}
+#endif	/* ATOMIC_PSHARED */
+
+/* Written by ISR threads that have to wait: bit n of pending is set
+   while vector n is waiting for interrupts to be enabled, entered counts
+   the ISR invocations that had to wait in isr_enter(). */
+struct _atomic_irq_t {
+	uint64_t pending;
+	uint64_t entered;
+} __ATOMIC_ALIGNED;
+
+struct _atomic_irq_t __attribute__((weak)) _atomic_irq;
+/* vector + 1 of an ISR thread, 0 in any other thread */
+__thread uint8_t __attribute__((weak)) _atomic_isr_vector = 0;
+
+#if defined(ATOMIC_TRACE)
+
+#ifndef ATOMIC_TRACE_EVENTS
+#  define ATOMIC_TRACE_EVENTS 4096
+#endif
+#if ATOMIC_TRACE_EVENTS & (ATOMIC_TRACE_EVENTS - 1)
+#  error "ATOMIC_TRACE_EVENTS has to be a power of two"
+#endif
+#ifndef ATOMIC_TRACE_FLUSH_MS
+#  define ATOMIC_TRACE_FLUSH_MS 100
+#endif
+
+#define __ATOMIC_TRACE_OFF 0
+#define __ATOMIC_TRACE_ON 1
+#define __ATOMIC_TRACE_PENDING 2
+#define __ATOMIC_TRACE_ENTERED 3
+
+struct _atomic_trace_event_t {
+	uint64_t stamp;	/* __traceClock(), in ns once paired up by the flusher */
+	const struct _atomic_site_t *site;
+	uint32_t arg;
+	uint8_t kind;
+};
+
+/* Single producer (the thread) / single consumer (the flusher) ring.
+   Allocated on the first event of a thread and never freed, like the
+   statistics. The flusher pairs the events up itself, so a dropped
+   event loses one interval but never unbalances the trace. */
+struct _atomic_trace_buf_t {
+	struct _atomic_trace_buf_t *next;
+	uint32_t tid;
+	uint8_t vector;
+	uint8_t named;
+	/* flusher side */
+	struct _atomic_trace_event_t off, pending;
+	uint64_t tail;
+	uint64_t head __ATOMIC_ALIGNED;
+	uint64_t dropped;
+	struct _atomic_trace_event_t ring[ATOMIC_TRACE_EVENTS] __ATOMIC_ALIGNED;
+};
+
+struct _atomic_trace_buf_t __attribute__((weak)) *_atomic_trace_bufs = NULL;
+__thread struct _atomic_trace_buf_t __attribute__((weak)) *_atomic_trace_buf = NULL;
+pthread_once_t __attribute__((weak)) _atomic_trace_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t __attribute__((weak)) _atomic_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+FILE __attribute__((weak)) *_atomic_trace_file = NULL;
+uint64_t __attribute__((weak)) _atomic_trace_epoch[2];
+
+static __inline__ uint64_t __traceNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Reading the TSC takes a few cycles where clock_gettime() takes tens
+   of nanoseconds, so x86 records ticks and the flusher scales them to
+   CLOCK_MONOTONIC against the epoch taken at start. */
+#if defined(__i386__) || defined(__x86_64__)
+#  define __traceClock() __builtin_ia32_rdtsc()
+#else
+#  define __traceClock() __traceNow()
+#endif
+
+static __inline__ uint64_t __traceNs(uint64_t stamp, double scale)
+{
+	return _atomic_trace_epoch[1] + (uint64_t)((double)(int64_t)(stamp - _atomic_trace_epoch[0]) * scale);
+}
+
+/* Writes s as the contents of a JSON string, __FILE__ may hold quotes,
+   backslashes or worse. */
+static __inline__ void __traceString(const char *s)
+{
+	for(; *s; s++)
+	{
+		unsigned char c = (unsigned char)*s;
+
+		if(c == '"' || c == '\\')
+			fprintf(_atomic_trace_file, "\\%c", c);
+		else if(c < 0x20)
+			fprintf(_atomic_trace_file, "\\u%04x", c);
+		else
+			putc(c, _atomic_trace_file);
+	}
+}
+
+static __inline__ void __traceWriteX(const struct _atomic_trace_buf_t *buf, const char *cat,
+                                     const struct _atomic_trace_event_t *begin, uint64_t end,
+                                     const char *argname, uint32_t arg)
+{
+	if(!begin->stamp)
+		return;
+	fprintf(_atomic_trace_file, "{\"name\":\"");
+	__traceString(begin->site ? begin->site->file : cat);
+	if(begin->site && begin->site->line)
+		fprintf(_atomic_trace_file, ":%u", begin->site->line);
+	fprintf(_atomic_trace_file, "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03u,\"dur\":%llu.%03u,"
+	        "\"pid\":%d,\"tid\":%u,\"args\":{\"%s\":%u}},\n", cat,
+	        (unsigned long long)(begin->stamp / 1000), (unsigned)(begin->stamp % 1000),
+	        (unsigned long long)((end - begin->stamp) / 1000), (unsigned)((end - begin->stamp) % 1000),
+	        (int)getpid(), buf->tid, argname, arg);
+}
+
+/* Drains all thread buffers into the trace file, turning begin/end
+   pairs into complete ("X") events of the Chrome trace format. */
+static __attribute__((noinline, unused)) void atomic_trace_flush(void)
+{
+	struct _atomic_trace_buf_t *buf;
+	uint64_t ticks = __traceClock(), now = __traceNow();
+	double scale = 1.0;
+
+	pthread_mutex_lock(&_atomic_trace_lock);
+	if(!_atomic_trace_file)
+	{
+		pthread_mutex_unlock(&_atomic_trace_lock);
+		return;
+	}
+	if(ticks > _atomic_trace_epoch[0])
+		scale = (double)(now - _atomic_trace_epoch[1]) / (double)(ticks - _atomic_trace_epoch[0]);
+	for(buf = __atomic_load_n(&_atomic_trace_bufs, __ATOMIC_ACQUIRE); buf; buf = buf->next)
+	{
+		uint64_t head = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE), dropped;
+
+		if(!buf->named)
+		{
+			buf->named = 1;
+			if(buf->vector)
+				fprintf(_atomic_trace_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+				        "\"args\":{\"name\":\"ISR %u\"}},\n", (int)getpid(), buf->tid, buf->vector - 1u);
+		}
+		while(buf->tail != head)
+		{
+			const struct _atomic_trace_event_t *ev = &buf->ring[buf->tail & (ATOMIC_TRACE_EVENTS - 1)];
+			uint64_t ns = __traceNs(ev->stamp, scale);
+
+			switch(ev->kind)
+			{
+			case __ATOMIC_TRACE_OFF:
+				buf->off = *ev;
+				buf->off.stamp = ns;
+				break;
+			case __ATOMIC_TRACE_ON:
+				__traceWriteX(buf, "interrupts off", &buf->off, ns, "domains", buf->off.arg);
+				buf->off.stamp = 0;
+				break;
+			case __ATOMIC_TRACE_PENDING:
+				buf->pending = *ev;
+				buf->pending.stamp = ns;
+				break;
+			case __ATOMIC_TRACE_ENTERED:
+				__traceWriteX(buf, "pending", &buf->pending, ns, "vector", buf->pending.arg);
+				buf->pending.stamp = 0;
+				break;
+			}
+			__atomic_store_n(&buf->tail, buf->tail + 1, __ATOMIC_RELEASE);
+		}
+		if((dropped = __atomic_exchange_n(&buf->dropped, 0, __ATOMIC_RELAXED)))
+			fprintf(_atomic_trace_file, "{\"name\":\"%llu events dropped\",\"ph\":\"i\",\"s\":\"t\","
+			        "\"ts\":%llu,\"pid\":%d,\"tid\":%u},\n", (unsigned long long)dropped,
+			        (unsigned long long)(now / 1000), (int)getpid(), buf->tid);
+	}
+	fflush(_atomic_trace_file);
+	pthread_mutex_unlock(&_atomic_trace_lock);
+}
+
+static __inline__ void *__traceFlusher(void *arg)
+{
+	struct timespec ts = { ATOMIC_TRACE_FLUSH_MS / 1000, (ATOMIC_TRACE_FLUSH_MS % 1000) * 1000000L };
+
+	(void)arg;
+	for(;;)
+	{
+		nanosleep(&ts, NULL);
+		atomic_trace_flush();
+	}
+	return NULL;
+}
+
+/* The JSON array format of the Chrome trace allows the closing bracket to
+   be missing, so an aborted run still leaves a readable file. */
+static __inline__ void __traceAtExit(void)
+{
+	atomic_trace_flush();
+	pthread_mutex_lock(&_atomic_trace_lock);
+	if(_atomic_trace_file)
+	{
+		fprintf(_atomic_trace_file, "{}]\n");
+		fclose(_atomic_trace_file);
+		_atomic_trace_file = NULL;
+	}
+	pthread_mutex_unlock(&_atomic_trace_lock);
+}
+
+static __inline__ void __traceStart(void)
+{
+	const char *name = getenv("ATOMIC_TRACE_FILE");
+	pthread_t flusher;
+	sigset_t all, old;
+
+	if(!(_atomic_trace_file = fopen(name ? name : "atomic_trace.json", "w")))
+		return;
+	_atomic_trace_epoch[0] = __traceClock();
+	_atomic_trace_epoch[1] = __traceNow();
+	fprintf(_atomic_trace_file, "[\n");
+	atexit(__traceAtExit);
+	/* The flusher must not take signals meant for the program. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if(!pthread_create(&flusher, NULL, __traceFlusher, NULL))
+		pthread_detach(flusher);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static __attribute__((noinline, unused)) struct _atomic_trace_buf_t *__traceBufAlloc(void)
+{
+	void *mem;
+	struct _atomic_trace_buf_t *buf;
+
+	pthread_once(&_atomic_trace_once, __traceStart);
+	if(posix_memalign(&mem, ATOMIC_CACHE_LINE, sizeof(*buf)))
+		abort();
+	buf = (struct _atomic_trace_buf_t *)memset(mem, 0, sizeof(*buf));
+	buf->tid = __atomicTid();
+	buf->vector = _atomic_isr_vector;
+	buf->next = __atomic_load_n(&_atomic_trace_bufs, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&_atomic_trace_bufs, &buf->next, buf,
+	                                   1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return _atomic_trace_buf = buf;
+}
+
+/* A clock read and a few stores into the thread's own ring; a full ring
+   drops the event instead of waiting for the flusher. */
+static __inline__ void __traceEvent(uint8_t kind, uint32_t arg)
+{
+	struct _atomic_trace_buf_t *buf = _atomic_trace_buf;
+	struct _atomic_trace_event_t *ev;
+	uint64_t head;
+
+	if(__builtin_expect(!buf, 0))
+		buf = __traceBufAlloc();
+	head = buf->head;
+	if(head - __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE) >= ATOMIC_TRACE_EVENTS)
+	{
+		__atomic_fetch_add(&buf->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	ev = &buf->ring[head & (ATOMIC_TRACE_EVENTS - 1)];
+	ev->stamp = __traceClock();
+	ev->site = __trackTop();
+	ev->arg = arg;
+	ev->kind = kind;
+	__atomic_store_n(&buf->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#else	/* !ATOMIC_TRACE */
+
+#define __traceEvent(kind, arg) ((void)(arg))
+
+#endif	/* ATOMIC_TRACE */
+
+#if defined(ATOMIC_LOCK_ORDER)
+
+#ifndef ATOMIC_LOCK_ORDER_EDGES
+#  define ATOMIC_LOCK_ORDER_EDGES 1024
+#endif
+#if ATOMIC_LOCK_ORDER_EDGES & (ATOMIC_LOCK_ORDER_EDGES - 1)
+#  error "ATOMIC_LOCK_ORDER_EDGES has to be a power of two"
+#endif
+
+#define __ATOMIC_ORDER_HELD 16
+
+/* Edge "to was taken while from was held" of the lock order graph. The
+   nodes are the lock domains, numbered 1 .. ATOMIC_DOMAINS, and mutexes,
+   named by their address. Edges are only ever added, under
+   _atomic_order_lock, and to is stored last, so looking one up takes no
+   lock. */
+struct _atomic_order_edge_t {
+	uintptr_t from, to;
+	const struct _atomic_site_t *site;
+	uint32_t tid;
+};
+
+struct _atomic_order_edge_t __attribute__((weak)) _atomic_order_edges[ATOMIC_LOCK_ORDER_EDGES];
+pthread_mutex_t __attribute__((weak)) _atomic_order_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t __attribute__((weak)) _atomic_order_inversions = 0;
+
+/* Mutexes held by the thread, the domains are in _atomic_mask. */
+__thread uintptr_t __attribute__((weak)) _atomic_order_held[__ATOMIC_ORDER_HELD];
+__thread uint8_t __attribute__((weak)) _atomic_order_depth = 0;
+
+static __inline__ unsigned __orderHash(uintptr_t from, uintptr_t to)
+{
+	return (unsigned)((((uint64_t)from * 0x9e3779b97f4a7c15ull) ^ to) * 0xff51afd7ed558ccdull >> 40);
+}
+
+/* A full table counts everything as known, so it stops learning rather
+   than slowing every lock down. */
+static __inline__ const struct _atomic_order_edge_t *__orderFind(uintptr_t from, uintptr_t to)
+{
+	unsigned hash = __orderHash(from, to);
+
+	for(unsigned i = 0; i < ATOMIC_LOCK_ORDER_EDGES; i++, hash++)
+	{
+		const struct _atomic_order_edge_t *edge = &_atomic_order_edges[hash & (ATOMIC_LOCK_ORDER_EDGES - 1)];
+		uintptr_t known = __atomic_load_n(&edge->to, __ATOMIC_ACQUIRE);
+
+		if(!known)
+			return NULL;
+		if(known == to && edge->from == from)
+			return edge;
+	}
+	return _atomic_order_edges;
+}
+
+/* Breadth first search for a path from start to goal, returning the
+   edge leaving start it begins with. Only runs for edges not seen
+   before, with _atomic_order_lock held. */
+static __inline__ const struct _atomic_order_edge_t *__orderPath(uintptr_t start, uintptr_t goal)
+{
+	static struct { uintptr_t node; const struct _atomic_order_edge_t *first; } queue[ATOMIC_LOCK_ORDER_EDGES + 1];
+	unsigned head = 0, tail = 0;
+
+	queue[tail].node = start;
+	queue[tail++].first = NULL;
+	while(head < tail)
+	{
+		uintptr_t node = queue[head].node;
+		const struct _atomic_order_edge_t *first = queue[head++].first;
+
+		for(unsigned i = 0; i < ATOMIC_LOCK_ORDER_EDGES; i++)
+		{
+			const struct _atomic_order_edge_t *edge = &_atomic_order_edges[i];
+			unsigned seen = 0;
+
+			if(!edge->to || edge->from != node)
+				continue;
+			if(edge->to == goal)
+				return first ? first : edge;
+			while(seen < tail && queue[seen].node != edge->to)
+				seen++;
+			if(seen == tail && tail <= ATOMIC_LOCK_ORDER_EDGES)
+			{
+				queue[tail].node = edge->to;
+				queue[tail++].first = first ? first : edge;
+			}
+		}
+	}
+	return NULL;
+}
+
+static __inline__ char *__orderNode(char *p, uintptr_t node)
+{
+	if(node <= ATOMIC_DOMAINS)
+	{
+		p = __eventString(p, "domain ");
+		return __eventNumber(p, node - 1, 10);
+	}
+	p = __eventString(p, "mutex 0x");
+	return __eventNumber(p, node, 16);
+}
+
+static __inline__ char *__orderSite(char *p, const struct _atomic_site_t *site, uint32_t tid)
+{
+	if(site && strlen(site->file) < 128)
+	{
+		p = __eventString(p, " at ");
+		p = __eventString(p, site->file);
+		if(site->line)
+		{
+			*p++ = ':';
+			p = __eventNumber(p, site->line, 10);
+		}
+	}
+	p = __eventString(p, " (tid ");
+	p = __eventNumber(p, tid, 10);
+	return __eventString(p, ")");
+}
+
+/* Written right away rather than queued, the inversion may well hang
+   the program next. */
+static __inline__ void __orderReport(const struct _atomic_order_edge_t *edge,
+                                     const struct _atomic_order_edge_t *back)
+{
+	char buf[512], *p = buf;
+
+	p = __eventString(p, "lock order inversion: ");
+	p = __orderNode(p, edge->to);
+	p = __eventString(p, " taken holding ");
+	p = __orderNode(p, edge->from);
+	p = __orderSite(p, edge->site, edge->tid);
+	p = __eventString(p, ", but ");
+	p = __orderNode(p, back->to);
+	p = __eventString(p, " taken holding ");
+	p = __orderNode(p, back->from);
+	p = __orderSite(p, back->site, back->tid);
+	*p++ = '\n';
+	if(write(2, buf, p - buf) < 0)
+		return;
+}
+
+/* Returns whether the new edge closes a cycle, which is reported unless
+   quiet is set. */
+static __attribute__((noinline, cold, unused)) uint8_t __orderAdd(uintptr_t from, uintptr_t to,
+                                                                   const struct _atomic_site_t *site, uint8_t quiet)
+{
+	const struct _atomic_order_edge_t *back = NULL;
+
+	pthread_mutex_lock(&_atomic_order_lock);
+	if(!__orderFind(from, to))
+	{
+		unsigned hash = __orderHash(from, to);
+		struct _atomic_order_edge_t *edge;
+
+		back = __orderPath(to, from);
+		while((edge = &_atomic_order_edges[hash++ & (ATOMIC_LOCK_ORDER_EDGES - 1)])->to)
+			;
+		edge->from = from;
+		edge->site = site;
+		edge->tid = __atomicTid();
+		__atomic_store_n(&edge->to, to, __ATOMIC_RELEASE);
+		if(back && !quiet)
+		{
+			__atomic_fetch_add(&_atomic_order_inversions, 1, __ATOMIC_RELAXED);
+			__orderReport(edge, back);
+		}
+	}
+	pthread_mutex_unlock(&_atomic_order_lock);
+	return back != NULL;
+}
+
+/* Records the edges from everything the thread holds, domains and
+   mutexes, to the lock it is about to wait for. Known edges cost a
+   hash lookup each. A block holding several domains reports only the
+   first inversion it runs into. */
+static __inline__ void __orderAcquire(uintptr_t to, uint8_t domains, const struct _atomic_site_t *site)
+{
+	uint8_t depth = _atomic_order_depth < __ATOMIC_ORDER_HELD ? _atomic_order_depth : __ATOMIC_ORDER_HELD;
+	uint8_t reported = 0;
+
+	for(uint8_t domain = 0; domains; domain++, domains >>= 1)
+		if((domains & 1) && !__orderFind(domain + 1u, to))
+			reported |= __orderAdd(domain + 1u, to, site, reported);
+	for(uint8_t i = 0; i < depth; i++)
+		if(_atomic_order_held[i] != to && !__orderFind(_atomic_order_held[i], to))
+			reported |= __orderAdd(_atomic_order_held[i], to, site, reported);
+}
+
+static __inline__ void __orderPush(uintptr_t node)
+{
+	if(_atomic_order_depth < __ATOMIC_ORDER_HELD)
+		_atomic_order_held[_atomic_order_depth] = node;
+	_atomic_order_depth++;
+}
+
+static __inline__ void __orderPop(uintptr_t node)
+{
+	uint8_t depth = _atomic_order_depth < __ATOMIC_ORDER_HELD ? _atomic_order_depth : __ATOMIC_ORDER_HELD;
+
+	if(!_atomic_order_depth)
+		return;
+	/* mutexes need not be released in reverse order */
+	for(uint8_t i = depth; i--; )
+	{
+		if(_atomic_order_held[i] == node)
+		{
+			memmove(&_atomic_order_held[i], &_atomic_order_held[i + 1], (depth - i - 1) * sizeof(uintptr_t));
+			break;
+		}
+	}
+	_atomic_order_depth--;
+}
+
+static __inline__ int __orderMutexLock(pthread_mutex_t *mutex, const struct _atomic_site_t *site)
+{
+	int ret;
+
+	__orderAcquire((uintptr_t)mutex, _atomic_mask, site);
+	if(!(ret = (pthread_mutex_lock)(mutex)))
+		__orderPush((uintptr_t)mutex);
+	return ret;
+}
+
+/* A try lock never waits, so it adds no edges. */
+static __inline__ int __orderMutexTrylock(pthread_mutex_t *mutex)
+{
+	int ret;
+
+	if(!(ret = (pthread_mutex_trylock)(mutex)))
+		__orderPush((uintptr_t)mutex);
+	return ret;
+}
+
+static __inline__ int __orderMutexUnlock(pthread_mutex_t *mutex)
+{
+	__orderPop((uintptr_t)mutex);
+	return (pthread_mutex_unlock)(mutex);
+}
+
+static __inline__ uint64_t atomic_lock_order_inversions(void)
+{
+	return __atomic_load_n(&_atomic_order_inversions, __ATOMIC_RELAXED);
+}
+
+#else	/* !ATOMIC_LOCK_ORDER */
+
+#define __orderAcquire(to, domains, site) ((void)(domains))
+
+#endif	/* ATOMIC_LOCK_ORDER */
+
+#if defined(ATOMIC_SIM)
+typedef void (*_atomic_sim_handler_t)(void);
+
+_atomic_sim_handler_t __attribute__((weak)) _atomic_sim_handler[64] = { 0 };
+uint32_t __attribute__((weak)) _atomic_sim_period[64] = { 0 };
+uint64_t __attribute__((weak)) _atomic_sim_periodic = 0;
+uint64_t __attribute__((weak)) _atomic_sim_registered = 0;
+uint64_t __attribute__((weak)) _atomic_sim_ticks = 0;
+uint64_t __attribute__((weak)) _atomic_sim_random = 0;
+uint32_t __attribute__((weak)) _atomic_sim_fuzz = 0;
+
+/* Runs the pending handlers, lowest vector first like the AVR interrupt
+   priorities, each with interrupts disabled and enabled again after it
+   as by reti. A handler enabling interrupts itself gets interrupted by
+   the next pending vector right there. */
+static __attribute__((noinline, unused)) void __simDispatch(void)
+{
+#if defined(__ATOMIC_SITES)
+	static const struct _atomic_site_t __site = { "sim dispatch", 0 };
+#endif
+
+	while(!_atomic_mask && _atomic_irq.pending)
+	{
+		uint8_t vector = (uint8_t)__builtin_ctzll(_atomic_irq.pending);
+
+		_atomic_irq.pending &= ~((uint64_t)1 << vector);
+		if(!_atomic_sim_handler[vector])
+			continue;
+#if defined(__ATOMIC_SITES)
+		__trackPush(&__site);
+#endif
+		_atomic_mask = __ATOMIC_ALL;
+		__trackAcquired(ATOMIC_DOMAINS, 0);
+		__traceEvent(__ATOMIC_TRACE_OFF, __ATOMIC_ALL);
+		_atomic_sim_handler[vector]();
+		__trackReleased(__builtin_popcount(_atomic_mask));
+		__traceEvent(__ATOMIC_TRACE_ON, 0);
+		_atomic_mask = 0;
+		__trackPop();
+	}
+}
+
+/* Raises one of the registered vectors with a chance of 1 in
+   _atomic_sim_fuzz, drawn from a xorshift64* generator so a seed
+   always replays the same interleaving. */
+static __attribute__((noinline, unused)) void __simFuzz(void)
+{
+	uint64_t x = _atomic_sim_random, registered = _atomic_sim_registered;
+	unsigned pick;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	_atomic_sim_random = x;
+	x *= 0x2545f4914f6cdd1dull;
+	if(!registered || (uint32_t)x % _atomic_sim_fuzz)
+		return;
+	for(pick = (unsigned)((x >> 32) % (uint64_t)__builtin_popcountll(registered)); pick; pick--)
+		registered &= registered - 1;
+	_atomic_irq.pending |= registered & -registered;
+}
+
+static __inline__ void __simPoll(void)
+{
+	if(__builtin_expect(_atomic_sim_fuzz != 0, 0))
+		__simFuzz();
+	if(__builtin_expect(_atomic_irq.pending != 0, 0))
+		__simDispatch();
+}
+
+#define __seiHook() __simPoll()
+#else	/* !ATOMIC_SIM */
+/* Set by a runtime that dispatches latched interrupts itself, like the
+   ISR pool of atomic_isr.h. It is called whenever a thread enables
+   interrupts while vectors are pending. */
+void (*_atomic_unmask_hook)(void) __attribute__((weak)) = NULL;
+
+/* The fence pairs with the pending bit being set before the lock is
+   tried, so either this thread sees the bit or the other one gets the
+   lock. */
+static __attribute__((noinline, unused)) void __unmaskNotify(void (*hook)(void))
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&_atomic_irq.pending, __ATOMIC_RELAXED))
+		hook();
+}
+
+#if defined(ATOMIC_ISR_HANDOFF)
+/* Like the AVR, which runs a pending interrupt right after sei, a thread
+   re-enabling interrupts waits until the ISR threads that were pending
+   at that moment got the lock, instead of racing them for it. Those
+   increment _atomic_irq.entered once they are in. */
+static __attribute__((noinline, unused)) void __isrHandoff(uint64_t waiting)
+{
+	uint64_t entered = __atomic_load_n(&_atomic_irq.entered, __ATOMIC_ACQUIRE);
+	unsigned count = (unsigned)__builtin_popcountll(waiting);
+
+	for(unsigned spins = 0; __atomic_load_n(&_atomic_irq.pending, __ATOMIC_ACQUIRE) & waiting; spins++)
+	{
+		if(__atomic_load_n(&_atomic_irq.entered, __ATOMIC_ACQUIRE) - entered >= count)
+			break;
+		if(spins < ATOMIC_SPIN_COUNT)
+			__cpu_relax();
+		else
+			sched_yield();
+	}
+}
+#endif	/* ATOMIC_ISR_HANDOFF */
+
+static __inline__ void __seiHook(void)
+{
+	void (*hook)(void) = __atomic_load_n(&_atomic_unmask_hook, __ATOMIC_RELAXED);
+#if defined(ATOMIC_ISR_HANDOFF)
+	uint64_t waiting;
+#endif
+
+	if(__builtin_expect(hook != NULL, 0))
+		__unmaskNotify(hook);
+#if defined(ATOMIC_ISR_HANDOFF)
+	waiting = __atomic_load_n(&_atomic_irq.pending, __ATOMIC_RELAXED);
+	if(__builtin_expect(waiting != 0, 0) && !_atomic_isr_vector)
+		__isrHandoff(waiting);
+#endif
+}
+#endif	/* ATOMIC_SIM */
 
-#ifndef PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
-#  ifdef PTHREAD_RECURSIVE_MUTEX_INITIALIZER
-#    define PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP PTHREAD_RECURSIVE_MUTEX_INITIALIZER
+/* sreg_save keeps the domains held at entry in bits 0-7 and the domains
+   of the block in bits 8-15. Bit 16 is preset by FORCEON/FORCEOFF, which
+   only the entry helpers look at, bit 17 marks a block counted by an
+   ATOMIC_BLOCK_BATCH. */
+#define __ATOMIC_FORCE ((uint32_t)1 << 16)
+#define __ATOMIC_BATCHED ((uint32_t)1 << 17)
+
+#ifndef ATOMIC_DIAG
+#  if defined(NDEBUG)
+#    define ATOMIC_DIAG 0
 #  else
-#    error "PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP undefined, make sure to define _GNU_SOURCE globally"
+#    define ATOMIC_DIAG 1
 #  endif
 #endif
 
-#if !defined(__DOXYGEN__)
-/* Internal helper functions. */
+/* Domains are always locked in ascending and unlocked in descending order,
+   a plain ATOMIC_BLOCK covers all of them. A forced transition of a
+   domain that already is in the requested state is what got reported as
+   nesting non recursive locks. type is a constant once the helpers are
+   inlined, so RESTORESTATE blocks, or all blocks with ATOMIC_DIAG 0,
+   don't contain the check at all. */
+static __inline__ void __seiMask(uint8_t want, uint8_t type)
+{
+	uint8_t release = want & _atomic_mask, released = 0;
+
+	if(ATOMIC_DIAG && type && release != want)
+		__diagNested(__trackTop(), _atomic_mask);
+	if(!release)
+		return;
+	for(uint8_t domain = ATOMIC_DOMAINS; domain--; )
+	{
+		if(release & (1u << domain))
+		{
+			__seqWriteEnd(domain);
+			__atomicUnlock(domain);
+			released++;
+		}
+	}
+	__atomicProbe(sei, _atomic_mask, release);
+	_atomic_mask &= ~release;
+	__trackReleased(released);
+	if(!_atomic_mask)
+	{
+		__traceEvent(__ATOMIC_TRACE_ON, 0);
+		__seiHook();
+	}
+}
+
+static __inline__ void __cliMask(uint8_t want, uint8_t type)
+{
+	uint8_t take = want & ~_atomic_mask, took = 0;
+	uint64_t wait = 0;
+
+	if(ATOMIC_DIAG && type && take != want)
+		__diagNested(__trackTop(), _atomic_mask);
+	if(!take)
+		return;
+	__atomicProbe(cli_begin, _atomic_mask, take);
+	for(uint8_t domain = 0; domain < ATOMIC_DOMAINS; domain++)
+	{
+		if(take & (1u << domain))
+		{
+			__orderAcquire(domain + 1u, _atomic_mask | (take & ((1u << domain) - 1)), __trackTop());
+			__trackLock(domain, &wait);
+			__seqWriteBegin(domain);
+			took++;
+		}
+	}
+	__atomicProbe(cli_end, _atomic_mask, take);
+	if(!_atomic_mask)
+		__traceEvent(__ATOMIC_TRACE_OFF, take);
+	_atomic_mask |= take;
+	__trackAcquired(took, wait);
+}
+
+/* State of the innermost ATOMIC_BLOCK_BATCH of the thread. depth counts
+   the blocks nested inside it that found interrupts off already, only
+   those at depth 1 are sections of the batch. */
+struct _atomic_batch_t {
+	uint8_t active, depth;
+	uint16_t limit, count;
+	const struct _atomic_site_t *site;
+#if defined(ATOMIC_STATS)
+	uint64_t start;
+#endif
+};
+
+__thread struct _atomic_batch_t __attribute__((weak)) _atomic_batch;
+
+/* Lets pending interrupts in between two sections of a batch, accounting
+   the lock operations to the batch rather than the section. */
+static __inline__ void __batchBreak(void)
+{
+	const struct _atomic_site_t *site = __trackSwap(_atomic_batch.site);
+	uint8_t held = _atomic_mask;
+
+	__seiMask(held, 0);
+	__cliMask(held, 0);
+	(void)__trackSwap(site);
+}
+
+static __attribute__((noinline, unused)) void __batchEnter(void)
+{
+	if(_atomic_batch.depth++)
+		return;
+	if(_atomic_batch.limit && ++_atomic_batch.count > _atomic_batch.limit)
+	{
+		_atomic_batch.count = 1;
+		__batchBreak();
+	}
+#if defined(ATOMIC_STATS)
+	_atomic_batch.start = __atomicNow();
+	__statsAcquired(__trackTop(), _atomic_batch.start, 0);
+#endif
+}
+
+/* A section reports its time as the hold of a block of its own would.
+   Returns whether the block was a section rather than nested deeper. */
+static __attribute__((noinline, unused)) uint8_t __batchLeave(void)
+{
+	if(!_atomic_batch.depth || --_atomic_batch.depth)
+		return 0;
+#if defined(ATOMIC_STATS)
+	__statsReleased(__trackTop(), __atomicNow() - _atomic_batch.start);
+#endif
+	return 1;
+}
+
+/* Entry of a block that finds its domains held already. Inside a batch
+   it is counted, and directly inside it is a section, which may be
+   FORCEON as well: on the target interrupts would be on in between.
+   Deeper down nesting is checked as without the batch. Returns whether
+   the batch took the block. Bare cli() and sei() don't come here. */
+static __inline__ uint8_t __batchOpen(uint8_t saved, uint8_t want, uint8_t type)
+{
+	if(saved != want || __builtin_expect(!_atomic_batch.active, 1))
+		return 0;
+	if(_atomic_batch.depth)
+		__cliMask(want, type);
+	__batchEnter();
+	return 1;
+}
+
+/* Takes all domains not held yet without blocking, or none at all. */
+static __inline__ uint8_t __cliTry(void)
+{
+	uint8_t take = __ATOMIC_ALL & ~_atomic_mask, took = 0;
 
-pthread_mutex_t __attribute__((weak)) _atomic_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-uint32_t __attribute__((weak)) _atomic_count = 0;
+	for(uint8_t domain = 0; domain < ATOMIC_DOMAINS; domain++)
+	{
+		if(!(take & (1u << domain)))
+			continue;
+		if(!__atomicTryLock(domain))
+		{
+			while(domain--)
+				if(take & (1u << domain))
+					__atomicUnlock(domain);
+			return 0;
+		}
+		took++;
+	}
+	for(uint8_t domain = 0; domain < ATOMIC_DOMAINS; domain++)
+		if(take & (1u << domain))
+			__seqWriteBegin(domain);
+	__atomicProbe(cli_end, _atomic_mask, take);
+	if(!_atomic_mask)
+		__traceEvent(__ATOMIC_TRACE_OFF, take);
+	_atomic_mask |= take;
+	__trackAcquired(took, 0);
+	return 1;
+}
 
 static __inline__ void __sei(uint8_t type)
 {
-	if(--_atomic_count && type)
-		fprintf(stderr, "you nested non recursive locks\n");
-	pthread_mutex_unlock(&_atomic_mutex);
+	__seiMask(__ATOMIC_ALL, type);
 }
 
 static __inline__ void __cli(uint8_t type)
 {
-	pthread_mutex_lock(&_atomic_mutex);
-	if(_atomic_count++ && type)
-		fprintf(stderr, "you nested non recursive locks\n");
+	__cliMask(__ATOMIC_ALL, type);
 }
 
-static __inline__ uint8_t __iSeiRetVal(uint8_t type)
+static __inline__ uint32_t __iSeiRetVal(uint32_t *sreg, uint8_t want)
 {
-	__sei(type);
+	*sreg |= ((uint32_t)want << 8) | (_atomic_mask & want);
+	__seiMask(want, *sreg >> 16);
 	return 1;
 }
 
-static __inline__ uint8_t __iCliRetVal(uint8_t type)
+static __inline__ uint32_t __iCliRetVal(uint32_t *sreg, uint8_t want)
 {
-	__cli(type);
+	*sreg |= ((uint32_t)want << 8) | (_atomic_mask & want);
+	if(__batchOpen((uint8_t)*sreg, want, *sreg >> 16))
+		*sreg |= __ATOMIC_BATCHED;
+	else
+		__cliMask(want, *sreg >> 16);
 	return 1;
 }
 
-static __inline__ void __iSeiParam(const uint8_t *type)
+/* One cleanup handler per block type, so the exit path doesn't decode
+   the type. No barrier here: a transition of the interrupt state is a
+   lock operation, which already orders the block's accesses, and a
+   block that doesn't change it needs none. */
+static __inline__ void __iSeiRestore(const uint32_t *sreg)
 {
-	__sei(*type);
-	__asm__ volatile ("" ::: "memory");
+	if(__builtin_expect(*sreg & __ATOMIC_BATCHED, 0))
+		__batchLeave();
+	else
+		__seiMask((uint8_t)(*sreg >> 8) & ~(uint8_t)*sreg, 0);
+	__trackPop();
 }
 
-static __inline__ void __iCliParam(const uint8_t *type)
+/* A FORCEON section ends in place, the batch keeps interrupts off. */
+static __inline__ void __iSeiForce(const uint32_t *sreg)
 {
-	__cli(*type);
-	__asm__ volatile ("" ::: "memory");
+	if(!(*sreg & __ATOMIC_BATCHED) || !__batchLeave())
+		__seiMask((uint8_t)(*sreg >> 8), 1);
+	__trackPop();
+}
+
+static __inline__ void __iCliRestore(const uint32_t *sreg)
+{
+	__cliMask((uint8_t)*sreg, 0);
+	__trackPop();
+}
+
+static __inline__ void __iCliForce(const uint32_t *sreg)
+{
+	__cliMask((uint8_t)(*sreg >> 8), 1);
+	__trackPop();
+}
+
+/* A batch nested into another atomic block never lets interrupts in. */
+static __inline__ struct _atomic_batch_t __iBatchBegin(unsigned sections, uint8_t nested)
+{
+	struct _atomic_batch_t saved = _atomic_batch;
+
+	_atomic_batch.active = 1;
+	_atomic_batch.depth = 0;
+	_atomic_batch.limit = nested ? 0 : (uint16_t)(sections < 0xffff ? sections : 0xffff);
+	_atomic_batch.count = 0;
+	_atomic_batch.site = __trackTop();
+	return saved;
+}
+
+static __inline__ void __iBatchEnd(const struct _atomic_batch_t *saved)
+{
+	_atomic_batch = *saved;
+}
+
+#if !defined(ATOMIC_SIM)
+struct _atomic_read_t {
+	uint32_t seq[ATOMIC_DOMAINS];
+	uint8_t run;
+};
+
+/* Domains the thread holds itself can't change under it, so they are
+   neither waited for nor checked. */
+static __inline__ void __readSnapshot(struct _atomic_read_t *read)
+{
+	uint8_t check = __ATOMIC_ALL & ~_atomic_mask;
+
+	for(uint8_t domain = 0; domain < ATOMIC_DOMAINS; domain++)
+	{
+		if(!(check & (1u << domain)))
+			continue;
+		for(unsigned spins = 0; (read->seq[domain] = __atomic_load_n(&__ATOMIC_LOCK(domain).seq, __ATOMIC_ACQUIRE)) & 1; spins++)
+		{
+			if(spins < ATOMIC_SPIN_COUNT)
+				__cpu_relax();
+			else
+				sched_yield();
+		}
+	}
+}
+
+static __inline__ struct _atomic_read_t __readBegin(void)
+{
+	struct _atomic_read_t read = { { 0 }, 1 };
+
+	__readSnapshot(&read);
+	return read;
+}
+
+/* Ends the loop of ATOMIC_READ_BLOCK once a run saw no writer. */
+static __inline__ void __readEnd(struct _atomic_read_t *read)
+{
+	uint8_t check = __ATOMIC_ALL & ~_atomic_mask;
+
+	read->run = 0;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	for(uint8_t domain = 0; domain < ATOMIC_DOMAINS; domain++)
+		if((check & (1u << domain)) &&
+		   __atomic_load_n(&__ATOMIC_LOCK(domain).seq, __ATOMIC_RELAXED) != read->seq[domain])
+			read->run = 1;
+	if(read->run)
+		__readSnapshot(read);
 }
+#endif	/* !ATOMIC_SIM */
 #endif	/* !__DOXYGEN__ */
 
 /** \file */
@@ -126,90 +2396,423 @@ static __inline__ void __iCliParam(const uint8_t *type)
     compiler will not optimize accesses to it away, it does not
     guarantee atomic access to it.  Assuming the following example:
 
-    \code
-#include <inttypes.h>
-#include <avr/interrupt.h>
-#include <avr/io.h>
+    \code
+#include <inttypes.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+volatile uint16_t ctr;
+
+ISR(TIMER1_OVF_vect)
+{
+  ctr--;
+}
+
+...
+int
+main(void)
+{
+   ...
+   ctr = 0x200;
+   start_timer();
+   while (ctr != 0)
+     // wait
+       ;
+   ...
+}
+    \endcode
+
+    There is a chance where the main context will exit its wait loop
+    when the variable \c ctr just reached the value 0xFF.  This happens
+    because the compiler cannot natively access a 16-bit variable
+    atomically in an 8-bit CPU.  So the variable is for example at
+    0x100, the compiler then tests the low byte for 0, which succeeds.
+    It then proceeds to test the high byte, but that moment the ISR
+    triggers, and the main context is interrupted.  The ISR will
+    decrement the variable from 0x100 to 0xFF, and the main context
+    proceeds.  It now tests the high byte of the variable which is
+    (now) also 0, so it concludes the variable has reached 0, and
+    terminates the loop.
+
+    Using the macros from this header file, the above code can be
+    rewritten like:
+
+    \code
+#include <inttypes.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+volatile uint16_t ctr;
+
+ISR(TIMER1_OVF_vect)
+{
+  ctr--;
+}
+
+...
+int
+main(void)
+{
+   ...
+   ctr = 0x200;
+   start_timer();
+   sei();
+   uint16_t ctr_copy;
+   do
+   {
+     ATOMIC_BLOCK(ATOMIC_FORCEON)
+     {
+       ctr_copy = ctr;
+     }
+   }
+   while (ctr_copy != 0);
+   ...
+}
+    \endcode
+
+    This will install the appropriate interrupt protection before
+    accessing variable \c ctr, so it is guaranteed to be consistently
+    tested.  If the global interrupt state were uncertain before
+    entering the ATOMIC_BLOCK, it should be executed with the
+    parameter ATOMIC_RESTORESTATE rather than ATOMIC_FORCEON.
+
+    See \ref optim_code_reorder for things to be taken into account
+    with respect to compiler optimizations.
+*/
+
+/** \def ATOMIC_LOCK_FUTEX
+    \ingroup util_atomic
+
+    Host-only build option. When defined before including this header,
+    the atomic blocks are serialized through a futex based lock instead
+    of the default pthread mutex per domain. The lock word holds the
+    tid of the owning thread, so an uncontended ATOMIC_BLOCK boils down
+    to one inlined compare-and-swap on entry and one exchange on exit.
+    A contended lock is spun on for ATOMIC_SPIN_COUNT rounds (default
+    100) before the waiter goes to sleep in the kernel, see also
+    ATOMIC_SPIN_ADAPTIVE.
+
+    All translation units of a program have to agree on this option.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_LOCK_FUTEX
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_SPIN_ADAPTIVE
+    \ingroup util_atomic
+
+    Host-only build option for either lock backend. Every lock owner
+    keeps a moving average of its hold times, and a waiter spins as long
+    as the current hold is shorter than twice that average (at least
+    ATOMIC_SPIN_COUNT and at most ATOMIC_SPIN_MAX rounds, default
+    10000), then sleeps. With the few instructions a typical atomic
+    block holds, the lock is taken over without a context switch. There
+    is no spinning on a single CPU or while all other CPUs spin on the
+    same domain already, as the owner could not make progress then.
+    Costs two clock reads (the time stamp counter on x86) per lock.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_SPIN_ADAPTIVE
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_USDT
+    \ingroup util_atomic
+
+    Host-only build option. Places USDT (SystemTap / DTrace style) static
+    probes of provider \c atomic into the inlined interrupt state
+    transitions, so perf, bpftrace or SystemTap can see atomic blocks
+    in an optimized build:
+
+    - \c cli_begin before a thread starts taking domains (ATOMIC_BLOCK
+      entry, NONATOMIC_BLOCK exit, cli(), isr_enter()),
+    - \c cli_end once it holds them, so the time between the two is the
+      lock wait,
+    - \c sei when it has released domains (ATOMIC_BLOCK exit,
+      NONATOMIC_BLOCK entry, sei(), isr_exit()).
+
+    Each probe passes file and line of the innermost block, the block
+    nesting depth, the domains held before and the domains that change.
+    The probes need <sys/sdt.h> (systemtap-sdt-dev or similar), the
+    build fails without it. With ATOMIC_USDT_OPTIONAL defined as well a
+    missing header only leaves the probes out, the option then just
+    keeps the call sites that would be reported.
+
+    \code
+perf probe -x ./sim sdt_atomic:cli_begin
+perf probe -x ./sim sdt_atomic:cli_end
+perf record -e sdt_atomic:cli_begin -e sdt_atomic:cli_end -g ./sim
+    \endcode
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_USDT
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_CACHE_LINE
+    \ingroup util_atomic
+
+    Host-only build option, defaults to 128 on x86-64, arm64 and
+    ppc64 and to 64 elsewhere. The state of each lock domain, the
+    latched ISR state, the diagnostics ring and the statistics of every
+    thread are aligned to and padded out to this size, so threads that
+    use different domains never write to the same cache line. Setting
+    it to 8 packs the state like plain arrays, for comparison.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_CACHE_LINE
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_DOMAINS
+    \ingroup util_atomic
+
+    Host-only build option, defaults to 1. Splits the lock behind the
+    atomic blocks into up to 8 independent domains, e.g. one per
+    simulated interrupt priority or peripheral. Code guarded by
+    ATOMIC_BLOCK_DOMAIN() only excludes other blocks of the same domain,
+    while a plain ATOMIC_BLOCK still excludes everything by taking all
+    domains in ascending order.
+
+    Domain blocks may only be nested in ascending domain order, and an
+    ATOMIC_BLOCK must not be nested inside an ATOMIC_BLOCK_DOMAIN, as
+    both would break the lock order and may deadlock.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_DOMAINS
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_ISR_HANDOFF
+    \ingroup util_atomic
+
+    Host-only build option. A thread that is not an ISR thread and
+    enables interrupts again (by leaving its outermost atomic block or
+    by sei()) while ISR threads wait in isr_enter() hands the lock over:
+    it waits until each of them got in before it continues, just like a
+    pending interrupt on the target fires right after \c sei. Without
+    it a main loop polling in a tight ATOMIC_BLOCK loop may win the lock
+    again and again and starve the ISR threads for milliseconds.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_ISR_HANDOFF
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_DIAG
+    \ingroup util_atomic
+
+    Host-only build option, defaults to 1 unless \c NDEBUG is defined.
+    Set to 0 to compile the nesting diagnostics of ATOMIC_FORCEON and
+    NONATOMIC_FORCEOFF blocks out, which leaves only the lock operations
+    in every block.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_DIAG
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_EVENT_RING
+    \ingroup util_atomic
+
+    Size (a power of two, default 256) of the lock-free ring that defers
+    diagnostics, like the "you nested non recursive locks" warning for
+    an ATOMIC_FORCEON block entered (or left) with interrupts disabled
+    already, or a NONATOMIC_FORCEOFF block with interrupts enabled.
+    Nothing is printed where such an event happens; the ring is written
+    to \c stderr at exit or whenever atomic_diag_flush() is called. Each
+    entry carries the thread id, the mask of held domains and the code
+    address of the offending block (plus its file and line with
+    ATOMIC_STATS or ATOMIC_LATENCY). Events arriving while the ring is
+    full are only counted.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_EVENT_RING
+
+/** \ingroup util_atomic
+
+    Writes the queued diagnostics to the file descriptor \c fd and
+    removes them from the ring. */
+void atomic_diag_flush(int fd);
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_STATS
+    \ingroup util_atomic
+
+    Host-only build option. Records for every atomic and non-atomic
+    block call site how often it was entered, how often it had to take
+    the lock and how long it waited for it, and how long the lock was
+    held from there (as a log2 histogram). The counters live in per
+    thread tables of ATOMIC_STATS_SITES (default 256) entries, and
+    atomic_stats_report() merges them into a report sorted by total hold
+    time, which is also written to \c stderr at exit.
+
+    Holds started by isr_enter() are reported as \c isr_enter().
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_STATS
+
+/** \ingroup util_atomic
+
+    Writes the ATOMIC_STATS report to \c out. */
+void atomic_stats_report(FILE *out);
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_CYCLE_BUDGET
+    \ingroup util_atomic
+
+    Host-only build option, implies ATOMIC_STATS. Estimates how many AVR
+    cycles every lock hold would take on the target and flags the call
+    sites whose holds exceed ATOMIC_CYCLE_BUDGET cycles, the longest any
+    block may keep interrupts off in the project.
+
+    The estimate scales the measured hold time, minus what timing an
+    empty hold costs on the host, by ATOMIC_CYCLES_PER_US AVR cycles per
+    host microsecond. The default 500 assumes the host runs the code
+    about 30 times as fast as a 16 MHz AVR; atomic_cycles_calibrate()
+    sets the factor from a reference function timed on both. The
+    ATOMIC_STATS report gets a table of estimated cycles per site, the
+    first hold over budget of every site is queued in the
+    ATOMIC_EVENT_RING, and a test can fail on atomic_cycles_exceeded() != 0.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_CYCLE_BUDGET
+
+/** \ingroup util_atomic
+
+    Sets the ATOMIC_CYCLE_BUDGET scale from a reference that took
+    \c host_ns nanoseconds on the host and \c avr_cycles cycles on the
+    target. */
+void atomic_cycles_calibrate(uint64_t host_ns, uint64_t avr_cycles);
+
+/** \ingroup util_atomic
+
+    Returns how many holds exceeded the ATOMIC_CYCLE_BUDGET. */
+uint64_t atomic_cycles_exceeded(void);
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_LATENCY
+    \ingroup util_atomic
+
+    Host-only build option. Measures every interval in which a thread
+    kept interrupts disabled, i.e. from the outermost ATOMIC_BLOCK (or
+    isr_enter()) taking the lock to the matching exit dropping it, which
+    is what bounds the interrupt latency on the target. The longest
+    interval, its call site and a histogram of all intervals are written
+    to \c stderr at exit, or on demand by atomic_latency_report().
+
+    Intervals longer than ATOMIC_LATENCY_THRESHOLD_US microseconds
+    (default 100, see also atomic_latency_set_threshold()) are counted
+    and queued in the ATOMIC_EVENT_RING, so the measured code is not
+    slowed down by stdio. A test can fail on atomic_latency_exceeded() != 0.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_LATENCY
+
+/** \ingroup util_atomic
+
+    Writes the ATOMIC_LATENCY report, including the queued threshold
+    violations, to \c out. */
+void atomic_latency_report(FILE *out);
+
+/** \ingroup util_atomic
+
+    Sets the ATOMIC_LATENCY threshold to \c us microseconds. */
+void atomic_latency_set_threshold(uint64_t us);
+
+/** \ingroup util_atomic
+
+    Returns how many intervals exceeded the ATOMIC_LATENCY threshold. */
+uint64_t atomic_latency_exceeded(void);
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_PSHARED
+    \ingroup util_atomic
+
+    Host-only build option for simulating several boards as processes
+    that exchange data through shared memory. The lock state of every
+    domain is reached through a pointer, and atomic_pshared_attach()
+    points the chosen domains at lock state in a segment all processes
+    map (ATOMIC_PSHARED_SIZE bytes, cache line aligned, zero filled
+    when created, e.g. by \c mmap() of \c MAP_SHARED memory or a
+    \c shm_open() file). Atomic blocks on those domains then exclude
+    the blocks of all processes, and ATOMIC_READ_BLOCK() readers see
+    their writes.
+
+    With the pthread backend the shared mutexes are
+    \c PTHREAD_PROCESS_SHARED and robust, so a process dying inside a
+    block only leaves the data it was writing behind; the futex backend
+    uses shared futexes and has no such recovery. Every process has to
+    be built with the same lock options, which is checked on attach.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_PSHARED
 
-volatile uint16_t ctr;
+/** \ingroup util_atomic
 
-ISR(TIMER1_OVF_vect)
-{
-  ctr--;
-}
+    Size of the segment atomic_pshared_attach() takes. */
+#define ATOMIC_PSHARED_SIZE
 
-...
-int
-main(void)
-{
-   ...
-   ctr = 0x200;
-   start_timer();
-   while (ctr != 0)
-     // wait
-       ;
-   ...
-}
-    \endcode
+/** \ingroup util_atomic
 
-    There is a chance where the main context will exit its wait loop
-    when the variable \c ctr just reached the value 0xFF.  This happens
-    because the compiler cannot natively access a 16-bit variable
-    atomically in an 8-bit CPU.  So the variable is for example at
-    0x100, the compiler then tests the low byte for 0, which succeeds.
-    It then proceeds to test the high byte, but that moment the ISR
-    triggers, and the main context is interrupted.  The ISR will
-    decrement the variable from 0x100 to 0xFF, and the main context
-    proceeds.  It now tests the high byte of the variable which is
-    (now) also 0, so it concludes the variable has reached 0, and
-    terminates the loop.
+    Moves the lock domains in \c domains (bit n for domain n) of the
+    calling process into \c segment, setting the segment up if it is
+    attached for the first time. To be called before any thread enters
+    an atomic block. Returns 0 on success or an errno value. */
+int atomic_pshared_attach(void *segment, uint8_t domains);
+#endif	/* __DOXYGEN__ */
 
-    Using the macros from this header file, the above code can be
-    rewritten like:
+/** \def ATOMIC_LOCK_ORDER
+    \ingroup util_atomic
 
-    \code
-#include <inttypes.h>
-#include <avr/interrupt.h>
-#include <avr/io.h>
-#include <util/atomic.h>
+    Host-only build option. Builds the graph of which locks every thread
+    waits for while holding others, covering the lock domains of atomic
+    blocks and, in translation units including this header, the
+    pthread_mutex_lock(), pthread_mutex_trylock() and
+    pthread_mutex_unlock() calls on the program's own mutexes (define
+    ATOMIC_LOCK_ORDER_NOWRAP to leave those alone). An edge closing a
+    cycle is a lock order inversion that can deadlock; it is written to
+    \c stderr right away, with the call sites of both orders, before the
+    program gets a chance to hang.
 
-volatile uint16_t ctr;
+    Edges already known cost one hash lookup per lock held, so the
+    checker can stay on in long test runs. The graph holds up to
+    ATOMIC_LOCK_ORDER_EDGES (default 1024) edges. A test can fail on
+    atomic_lock_order_inversions() != 0.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_LOCK_ORDER
 
-ISR(TIMER1_OVF_vect)
-{
-  ctr--;
-}
+/** \ingroup util_atomic
 
-...
-int
-main(void)
-{
-   ...
-   ctr = 0x200;
-   start_timer();
-   sei();
-   uint16_t ctr_copy;
-   do
-   {
-     ATOMIC_BLOCK(ATOMIC_FORCEON)
-     {
-       ctr_copy = ctr;
-     }
-   }
-   while (ctr_copy != 0);
-   ...
-}
-    \endcode
+    Returns how many lock order inversions ATOMIC_LOCK_ORDER reported. */
+uint64_t atomic_lock_order_inversions(void);
+#endif	/* __DOXYGEN__ */
 
-    This will install the appropriate interrupt protection before
-    accessing variable \c ctr, so it is guaranteed to be consistently
-    tested.  If the global interrupt state were uncertain before
-    entering the ATOMIC_BLOCK, it should be executed with the
-    parameter ATOMIC_RESTORESTATE rather than ATOMIC_FORCEON.
+/** \def ATOMIC_TRACE
+    \ingroup util_atomic
 
-    See \ref optim_code_reorder for things to be taken into account
-    with respect to compiler optimizations.
+    Host-only build option. Records when every thread disables and
+    enables interrupts, and when ISR threads start and stop waiting for
+    them, into a ring of ATOMIC_TRACE_EVENTS (default 4096) events per
+    thread. A background thread started with the first event drains the
+    rings every ATOMIC_TRACE_FLUSH_MS (default 100) milliseconds into a
+    Chrome trace file, named by the environment variable
+    \c ATOMIC_TRACE_FILE (default \c atomic_trace.json), which
+    chrome://tracing and ui.perfetto.dev open as a timeline:
+
+    - "interrupts off" spans from the outermost block taking the lock to
+      it being released, named by the call site, with the domains taken,
+    - "pending" spans in which an ISR thread waited in isr_enter(), with
+      the vector number.
+
+    Recording an event costs a clock read and a few stores into the ring
+    of the thread itself. Events arriving while a ring is full are
+    dropped and counted in the trace instead of waiting for the flusher.
 */
+#if defined(__DOXYGEN__)
+#define ATOMIC_TRACE
+
+/** \ingroup util_atomic
+
+    Writes the events recorded so far to the ATOMIC_TRACE file. */
+void atomic_trace_flush(void);
+#endif	/* __DOXYGEN__ */
 
 /** \def ATOMIC_BLOCK(type)
     \ingroup util_atomic
@@ -225,7 +2828,7 @@ main(void)
 #if defined(__DOXYGEN__)
 #define ATOMIC_BLOCK(type)
 #else
-#define ATOMIC_BLOCK(type) for ( type, __ToDo = __iCliRetVal(sreg_save); \
+#define ATOMIC_BLOCK(type) for ( type, __ToDo = (__ATOMIC_SITE_PUSH(), __iCliRetVal(&sreg_save, __ATOMIC_ALL)); \
 	                       __ToDo ; __ToDo = 0 )
 #endif	/* __DOXYGEN__ */
 
@@ -246,10 +2849,105 @@ main(void)
 #if defined(__DOXYGEN__)
 #define NONATOMIC_BLOCK(type)
 #else
-#define NONATOMIC_BLOCK(type) for ( type, __ToDo = __iSeiRetVal(sreg_save); \
+#define NONATOMIC_BLOCK(type) for ( type, __ToDo = (__ATOMIC_SITE_PUSH(), __iSeiRetVal(&sreg_save, __ATOMIC_ALL)); \
 	                          __ToDo ;  __ToDo = 0 )
 #endif	/* __DOXYGEN__ */
 
+/** \def ATOMIC_READ_BLOCK(type)
+    \ingroup util_atomic
+
+    Creates a block of code that only reads shared data, to take a
+    consistent snapshot of it like the \c ctr_copy example above. On
+    the target (see atomic_access.h) this is an ATOMIC_BLOCK with the
+    same \c type.
+
+    On the host the block doesn't lock anything: the body runs, and is
+    run again, until no atomic block of any other thread (or ISR
+    thread) took the lock in the meantime. So concurrent readers don't
+    serialize. Inside an atomic block, or with ATOMIC_SIM, the body runs
+    exactly once.
+
+    As the body may run more than once and on torn data, it must only
+    copy shared variables to locals, must not leave the block early and
+    must not contain atomic blocks itself.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_READ_BLOCK(type)
+#elif defined(ATOMIC_SIM)
+#define ATOMIC_READ_BLOCK(type) ATOMIC_BLOCK(type)
+#else
+#define ATOMIC_READ_BLOCK(type) for ( struct _atomic_read_t __read = __readBegin(); \
+	                            __read.run ; __readEnd(&__read) )
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_BLOCK_DOMAIN(domain, type)
+    \ingroup util_atomic
+
+    Like ATOMIC_BLOCK, but the block is only atomic with respect to
+    other blocks of the same \c domain (0 .. ATOMIC_DOMAINS - 1), see
+    ATOMIC_DOMAINS. Without domains configured this is the same as
+    ATOMIC_BLOCK.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_BLOCK_DOMAIN(domain, type)
+#else
+#define ATOMIC_BLOCK_DOMAIN(domain, type) for ( type, __ToDo = (__ATOMIC_SITE_PUSH(), __iCliRetVal(&sreg_save, __ATOMIC_DOMAIN(domain))); \
+	                                  __ToDo ; __ToDo = 0 )
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_BLOCK_BATCH(sections, type)
+    \ingroup util_atomic
+
+    An ATOMIC_BLOCK for loops of many small atomic blocks, such as one
+    per channel. The atomic blocks directly inside are its sections:
+    they find interrupts disabled already, so they cost no lock
+    operation on the host, and after every \c sections of them the
+    batch enables interrupts for a moment, as if there had been no
+    batch, so the latency stays bounded. ATOMIC_STATS still reports
+    every section as an entry, lock acquisition and hold of its own
+    block, the batch site gets the actual lock holds. A section may be
+    ATOMIC_FORCEON as well, it ends without enabling interrupts, since
+    on the target they would be on in between anyway. Bare cli() and
+    sei() are no sections: sei() ends the hold of the batch until the
+    next section, and the sections after that take the lock
+    themselves.
+
+    \code
+ATOMIC_BLOCK_BATCH(16, ATOMIC_RESTORESTATE)
+{
+  for(uint8_t ch = 0; ch < 64; ch++)
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { sample[ch] = adc_value[ch]; }
+}
+    \endcode
+
+    Code of the batch outside its sections must be correct without
+    being atomic, exactly like code between separate atomic blocks. A
+    batch nested into another atomic block keeps interrupts disabled
+    all the way. \c atomic_access.h maps the batch to a plain scope on
+    AVR, where the sections disable interrupts on their own.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_BLOCK_BATCH(sections, type)
+#else
+#define ATOMIC_BLOCK_BATCH(sections, type) ATOMIC_BLOCK(type) \
+	for ( struct _atomic_batch_t __batch __attribute__((__cleanup__(__iBatchEnd))) = \
+	      __iBatchBegin((sections), (uint8_t)sreg_save), *__batchToDo = &__batch; \
+	      __batchToDo ; __batchToDo = NULL )
+#endif	/* __DOXYGEN__ */
+
+/** \def NONATOMIC_BLOCK_DOMAIN(domain, type)
+    \ingroup util_atomic
+
+    The counterpart of NONATOMIC_BLOCK to be nested inside an
+    ATOMIC_BLOCK_DOMAIN of the same \c domain.
+*/
+#if defined(__DOXYGEN__)
+#define NONATOMIC_BLOCK_DOMAIN(domain, type)
+#else
+#define NONATOMIC_BLOCK_DOMAIN(domain, type) for ( type, __ToDo = (__ATOMIC_SITE_PUSH(), __iSeiRetVal(&sreg_save, __ATOMIC_DOMAIN(domain))); \
+	                                     __ToDo ; __ToDo = 0 )
+#endif	/* __DOXYGEN__ */
+
 /** \def ATOMIC_RESTORESTATE
     \ingroup util_atomic
 
@@ -264,8 +2962,8 @@ main(void)
 #if defined(__DOXYGEN__)
 #define ATOMIC_RESTORESTATE
 #else
-#define ATOMIC_RESTORESTATE uint8_t sreg_save \
-	__attribute__((__cleanup__(__iSeiParam))) = 0
+#define ATOMIC_RESTORESTATE uint32_t sreg_save \
+	__attribute__((__cleanup__(__iSeiRestore))) = 0
 #endif	/* __DOXYGEN__ */
 
 /** \def ATOMIC_FORCEON
@@ -285,8 +2983,8 @@ main(void)
 #if defined(__DOXYGEN__)
 #define ATOMIC_FORCEON
 #else
-#define ATOMIC_FORCEON uint8_t sreg_save \
-	__attribute__((__cleanup__(__iSeiParam))) = 1
+#define ATOMIC_FORCEON uint32_t sreg_save \
+	__attribute__((__cleanup__(__iSeiForce))) = __ATOMIC_FORCE
 #endif	/* __DOXYGEN__ */
 
 /** \def NONATOMIC_RESTORESTATE
@@ -303,8 +3001,8 @@ main(void)
 #if defined(__DOXYGEN__)
 #define NONATOMIC_RESTORESTATE
 #else
-#define NONATOMIC_RESTORESTATE uint8_t sreg_save \
-	__attribute__((__cleanup__(__iCliParam))) = 0
+#define NONATOMIC_RESTORESTATE uint32_t sreg_save \
+	__attribute__((__cleanup__(__iCliRestore))) = 0
 #endif	/* __DOXYGEN__ */
 
 /** \def NONATOMIC_FORCEOFF
@@ -324,8 +3022,352 @@ main(void)
 #if defined(__DOXYGEN__)
 #define NONATOMIC_FORCEOFF
 #else
-#define NONATOMIC_FORCEOFF uint8_t sreg_save \
-	__attribute__((__cleanup__(__iCliParam))) = 1
+#define NONATOMIC_FORCEOFF uint32_t sreg_save \
+	__attribute__((__cleanup__(__iCliForce))) = __ATOMIC_FORCE
+#endif	/* __DOXYGEN__ */
+
+/** \name Interrupt emulation
+
+    Threads that play the role of an interrupt service routine register
+    themselves with ISR_THREAD_REGISTER() and wrap each invocation of
+    the handler in isr_enter() and isr_exit(). Just like the hardware
+    won't start an ISR while the I bit is cleared, isr_enter() does not
+    return while any other thread is inside an ATOMIC_BLOCK, and for the
+    time the handler runs, atomic blocks in other threads have to wait.
+    So the handler body itself does not need any ATOMIC_BLOCK.
+
+    While an ISR thread waits in isr_enter(), its vector is latched in
+    the mask returned by isr_pending().
+
+    ISR_ENTER() and ISR_EXIT() stand for the implicit cli of the
+    interrupt entry and the \c reti at the end. The thread's I bit is
+    cleared in between like in a real ISR, so atomic blocks in the
+    handler cost nothing and a sei() in the body allows other vectors
+    in early. ISR_ENTER_NOBLOCK() is the counterpart of \c ISR_NOBLOCK:
+    the handler still waits for interrupts to be enabled, but then runs
+    with its I bit set and only takes the lock in its own atomic blocks,
+    leaving the rest of its body concurrent with other threads. The
+    same handler code works under ATOMIC_SIM and in the handlers of
+    atomic_isr.h, which run with interrupts disabled anyway.
+
+    \code
+void *timer_thread(void *arg)
+{
+  ISR_THREAD_REGISTER(TIMER1_OVF_vect_num);
+  for (;;)
+  {
+    wait_for_tick();
+    isr_enter();
+    ctr--;
+    isr_exit();
+  }
+}
+    \endcode
+*/
+/*@{*/
+
+/** \def ISR_THREAD_REGISTER(vector)
+    \ingroup util_atomic
+
+    Registers the calling thread as the handler of interrupt \c vector
+    (0 .. 63). Has to be called once before the thread uses isr_enter().
+*/
+#define ISR_THREAD_REGISTER(vector) (_atomic_isr_vector = (uint8_t)((vector) + 1))
+
+/** \ingroup util_atomic
+
+    Starts one invocation of the calling ISR thread. Blocks, with the
+    vector flagged as pending, as long as interrupts are disabled by an
+    atomic block of another thread.
+*/
+static __inline__ void isr_enter(void)
+{
+	uint64_t bit;
+
+#if defined(__ATOMIC_SITES)
+	static const struct _atomic_site_t __site = { "isr_enter()", 0 };
+
+	__trackPush(&__site);
+#endif
+	if(__builtin_expect(__cliTry(), 1))
+		return;
+
+	bit = (uint64_t)1 << ((_atomic_isr_vector - 1) & 63);
+	__atomic_fetch_or(&_atomic_irq.pending, bit, __ATOMIC_RELAXED);
+	__traceEvent(__ATOMIC_TRACE_PENDING, _atomic_isr_vector - 1u);
+	__cli(0);
+	__traceEvent(__ATOMIC_TRACE_ENTERED, 0);
+	__atomic_fetch_add(&_atomic_irq.entered, 1, __ATOMIC_RELEASE);
+	__atomic_fetch_and(&_atomic_irq.pending, ~bit, __ATOMIC_RELEASE);
+}
+
+/** \ingroup util_atomic
+
+    Ends the current invocation of the calling ISR thread, the
+    equivalent of \c reti.
+*/
+static __inline__ void isr_exit(void)
+{
+	__sei(0);
+	__trackPop();
+}
+
+/** \ingroup util_atomic
+
+    Starts one invocation of the calling ISR thread like isr_enter(),
+    then enables interrupts again as the first instruction of an
+    \c ISR_NOBLOCK handler does. Ended by isr_exit() as well.
+*/
+static __inline__ void isr_enter_noblock(void)
+{
+	isr_enter();
+	__sei(0);
+}
+
+/** \def ISR_ENTER()
+    \ingroup util_atomic
+
+    Entry of an interrupt handler body: waits until interrupts are
+    enabled and disables them for the calling thread, see isr_enter().
+*/
+/** \def ISR_ENTER_NOBLOCK()
+    \ingroup util_atomic
+
+    Entry of an \c ISR_NOBLOCK handler body, see isr_enter_noblock().
+*/
+/** \def ISR_EXIT()
+    \ingroup util_atomic
+
+    End of an interrupt handler body, the \c reti: enables interrupts
+    whatever the body left them at, see isr_exit().
+*/
+#define ISR_ENTER() isr_enter()
+#define ISR_ENTER_NOBLOCK() isr_enter_noblock()
+#define ISR_EXIT() isr_exit()
+
+/** \def SREG_I
+    \ingroup util_atomic
+
+    Bit number of the Global Interrupt Flag in the value returned by
+    atomic_sreg(), as in <avr/io.h>.
+*/
+#ifndef SREG_I
+#define SREG_I 7
+#endif
+
+/** \ingroup util_atomic
+
+    Returns the emulated SREG of the calling thread. Only the I bit is
+    maintained; it is cleared while the thread holds any domain, i.e.
+    inside an atomic block or between cli() and sei().
+*/
+static __inline__ uint8_t atomic_sreg(void)
+{
+	return _atomic_mask ? 0 : (uint8_t)(1u << SREG_I);
+}
+
+/** \ingroup util_atomic
+
+    Sets the I bit of the calling thread to the one in \c sreg, the
+    equivalent of <tt>SREG = sreg</tt>.
+*/
+static __inline__ void atomic_sreg_restore(uint8_t sreg)
+{
+	if(sreg & (1u << SREG_I))
+		__sei(0);
+	else
+		__cli(0);
+}
+
+/** \def cli()
+    \ingroup util_atomic
+
+    Disables interrupts for the calling thread, i.e. takes all domains
+    it doesn't hold yet. Like on the target it may be called while
+    interrupts are disabled already, and stays in effect until sei().
+    Not defined if <avr/interrupt.h> or a stub of it came first.
+*/
+#ifndef cli
+#define cli() __cli(0)
+#endif
+
+/** \def sei()
+    \ingroup util_atomic
+
+    Enables interrupts for the calling thread, i.e. releases every
+    domain it holds.
+*/
+#ifndef sei
+#define sei() __sei(0)
+#endif
+
+/** \ingroup util_atomic
+
+    Returns the mask of vectors (bit n for vector n) whose ISR thread is
+    currently held back by disabled interrupts.
+*/
+static __inline__ uint64_t isr_pending(void)
+{
+	return __atomic_load_n(&_atomic_irq.pending, __ATOMIC_RELAXED);
+}
+
+/*@}*/
+
+/** \name Interrupt simulation
+
+    With ATOMIC_SIM defined, the program runs in a single thread and the
+    interrupt handlers are plain callbacks. A raised vector stays
+    pending until interrupts are enabled at one of three points: sei(),
+    the exit of the outermost atomic block (or the entry of a
+    NONATOMIC_BLOCK) and sim_tick(). Pending handlers then run right
+    there, lowest vector first, so every run of a test takes exactly the
+    same interleaving and no block touches a lock.
+
+    \code
+static void timer_isr(void)
+{
+  ctr--;
+}
+
+int main(void)
+{
+  sim_isr_register(TIMER1_OVF_vect_num, timer_isr, 100);
+  for (;;)
+  {
+    sim_tick();
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      ...
+    }
+  }
+}
+    \endcode
+
+    ISR threads (isr_enter()) and other threads using atomic blocks
+    must not be combined with ATOMIC_SIM.
+*/
+/*@{*/
+
+/** \def ATOMIC_SIM
+    \ingroup util_atomic
+
+    Host-only build option, selects the interrupt simulation instead of
+    a lock backend.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_SIM
 #endif	/* __DOXYGEN__ */
 
+#if defined(ATOMIC_SIM) || defined(__DOXYGEN__)
+/** \ingroup util_atomic
+
+    Installs \c handler for \c vector (0 .. 63). A non-zero \c period
+    raises the vector every \c period calls of sim_tick().
+*/
+static __inline__ void sim_isr_register(uint8_t vector, void (*handler)(void), uint32_t period)
+{
+	vector &= 63;
+	_atomic_sim_handler[vector] = handler;
+	_atomic_sim_period[vector] = period;
+	if(handler)
+		_atomic_sim_registered |= (uint64_t)1 << vector;
+	else
+		_atomic_sim_registered &= ~((uint64_t)1 << vector);
+	if(period)
+		_atomic_sim_periodic |= (uint64_t)1 << vector;
+	else
+		_atomic_sim_periodic &= ~((uint64_t)1 << vector);
+}
+
+/** \ingroup util_atomic
+
+    Flags \c vector as pending, like the hardware setting an interrupt
+    flag. The handler runs at the next point interrupts are enabled.
+*/
+static __inline__ void sim_raise(uint8_t vector)
+{
+	_atomic_irq.pending |= (uint64_t)1 << (vector & 63);
+}
+
+/** \ingroup util_atomic
+
+    Advances the simulated time by one tick, raises the periodic vectors
+    that are due and runs the pending handlers unless interrupts are
+    disabled.
+*/
+static __inline__ void sim_tick(void)
+{
+	uint64_t ticks = ++_atomic_sim_ticks;
+
+	for(uint64_t periodic = _atomic_sim_periodic; periodic; periodic &= periodic - 1)
+	{
+		uint8_t vector = (uint8_t)__builtin_ctzll(periodic);
+
+		if(!(ticks % _atomic_sim_period[vector]))
+			_atomic_irq.pending |= (uint64_t)1 << vector;
+	}
+	if(!_atomic_mask)
+		__simPoll();
+}
+
+/** \ingroup util_atomic
+
+    Returns the number of sim_tick() calls so far.
+*/
+static __inline__ uint64_t sim_ticks(void)
+{
+	return _atomic_sim_ticks;
+}
+
+/** \ingroup util_atomic
+
+    Switches the interleaving fuzzer on: from now on every point where
+    interrupts get enabled and every sim_point() raises a randomly
+    chosen registered vector with a chance of 1 in \c one_in. The
+    choices only depend on \c seed, so a failing seed replays the same
+    interleaving. \c one_in = 0 switches the fuzzer off.
+
+    \code
+for (uint64_t seed = 1; seed <= 10000; seed++)
+{
+  reset_state();
+  sim_fuzz(seed, 4);
+  if (!run_test())
+    printf("failed with seed %llu\n", (unsigned long long)seed);
+}
+    \endcode
+*/
+static __inline__ void sim_fuzz(uint64_t seed, uint32_t one_in)
+{
+	/* splitmix64 step, xorshift must not start at 0 */
+	seed += 0x9e3779b97f4a7c15ull;
+	seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ull;
+	seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebull;
+	_atomic_sim_random = (seed ^ (seed >> 31)) | 1;
+	_atomic_sim_fuzz = one_in;
+}
+
+/** \ingroup util_atomic
+
+    A point where an interrupt may strike, e.g. between the bytes of a
+    multi-byte access (see SHARED_LOAD()). Runs the pending handlers,
+    including the ones the fuzzer raises, unless interrupts are
+    disabled.
+*/
+static __inline__ void sim_point(void)
+{
+	if(!_atomic_mask)
+		__simPoll();
+}
+#endif	/* ATOMIC_SIM || __DOXYGEN__ */
+
+/* Last, so the header's own mutexes stay out of the graph. */
+#if defined(ATOMIC_LOCK_ORDER) && !defined(ATOMIC_LOCK_ORDER_NOWRAP)
+#  define pthread_mutex_lock(mutex) __orderMutexLock((mutex), __ATOMIC_SITE())
+#  define pthread_mutex_trylock(mutex) __orderMutexTrylock(mutex)
+#  define pthread_mutex_unlock(mutex) __orderMutexUnlock(mutex)
+#endif
+
+/*@}*/
+
 #endif
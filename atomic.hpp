@@ -0,0 +1,128 @@
+/* C++ scope guards for the host emulation of <util/atomic.h>.
+
+   The guards call the same helpers as the ATOMIC_BLOCK/NONATOMIC_BLOCK
+   macros, but the policy is a template parameter, so no loop variable
+   or cleanup pointer is involved and everything inlines. A guard only
+   keeps the interrupt state it has to restore.
+*/
+
+#ifndef _UTIL_ATOMIC_HPP_
+#define _UTIL_ATOMIC_HPP_ 1
+
+#include "atomic.h"
+
+/** \file */
+/** \defgroup util_atomic_cxx C++ guards for atomic sections
+    \ingroup util_atomic
+
+    \code
+    #include "atomic.hpp"
+    \endcode
+
+    \code
+uint16_t read_ctr()
+{
+  util::atomic_guard<util::restore_state> guard;
+  return ctr;
+}
+    \endcode
+
+    atomic_guard corresponds to ATOMIC_BLOCK and may be used with the
+    restore_state (ATOMIC_RESTORESTATE) or force_on (ATOMIC_FORCEON)
+    policy, nonatomic_guard corresponds to NONATOMIC_BLOCK with
+    restore_state (NONATOMIC_RESTORESTATE) or force_off
+    (NONATOMIC_FORCEOFF). The optional second template parameter
+    selects a lock domain as with ATOMIC_BLOCK_DOMAIN().
+
+    \note Guards don't record a call site of their own, ATOMIC_STATS and
+    ATOMIC_LATENCY account them to the enclosing block.
+*/
+
+namespace util {
+
+/** \ingroup util_atomic_cxx
+    Policy of ATOMIC_RESTORESTATE and NONATOMIC_RESTORESTATE. */
+struct restore_state { static const uint8_t type = 0; };
+
+/** \ingroup util_atomic_cxx
+    Policy of ATOMIC_FORCEON. */
+struct force_on { static const uint8_t type = 1; };
+
+/** \ingroup util_atomic_cxx
+    Policy of NONATOMIC_FORCEOFF. */
+struct force_off { static const uint8_t type = 1; };
+
+/** \ingroup util_atomic_cxx
+    Domain argument selecting all domains, like a plain ATOMIC_BLOCK. */
+static const int all_domains = -1;
+
+#if !defined(__DOXYGEN__)
+template<class Policy> struct __atomicGuardPolicy { static const bool value = false; };
+template<> struct __atomicGuardPolicy<restore_state> { static const bool value = true; };
+template<> struct __atomicGuardPolicy<force_on> { static const bool value = true; };
+
+template<class Policy> struct __nonatomicGuardPolicy { static const bool value = false; };
+template<> struct __nonatomicGuardPolicy<restore_state> { static const bool value = true; };
+template<> struct __nonatomicGuardPolicy<force_off> { static const bool value = true; };
+#endif	/* !__DOXYGEN__ */
+
+/** \ingroup util_atomic_cxx
+
+    Executes the rest of the enclosing scope atomically. */
+template<class Policy = restore_state, int Domain = all_domains>
+class [[nodiscard]] atomic_guard
+{
+	static_assert(__atomicGuardPolicy<Policy>::value, "atomic_guard takes restore_state or force_on");
+	static_assert(Domain == all_domains || (Domain >= 0 && Domain < ATOMIC_DOMAINS), "no such domain");
+
+	static const uint8_t want = Domain == all_domains ? __ATOMIC_ALL : (uint8_t)(1u << (Domain & 7));
+	uint8_t saved, batched;
+
+public:
+	atomic_guard() noexcept : saved(_atomic_mask & want), batched(__batchOpen(saved, want, Policy::type))
+	{
+		if(!batched)
+			__cliMask(want, Policy::type);
+	}
+
+	~atomic_guard() noexcept
+	{
+		if(!batched || !__batchLeave())
+			__seiMask(Policy::type ? want : (uint8_t)(want & ~saved), Policy::type);
+	}
+
+	atomic_guard(const atomic_guard &) = delete;
+	atomic_guard &operator=(const atomic_guard &) = delete;
+};
+
+/** \ingroup util_atomic_cxx
+
+    Executes the rest of the enclosing scope non-atomically, to be used
+    inside an atomic_guard or ATOMIC_BLOCK. */
+template<class Policy = restore_state, int Domain = all_domains>
+class [[nodiscard]] nonatomic_guard
+{
+	static_assert(__nonatomicGuardPolicy<Policy>::value, "nonatomic_guard takes restore_state or force_off");
+	static_assert(Domain == all_domains || (Domain >= 0 && Domain < ATOMIC_DOMAINS), "no such domain");
+
+	static const uint8_t want = Domain == all_domains ? __ATOMIC_ALL : (uint8_t)(1u << (Domain & 7));
+	uint8_t saved;
+
+public:
+	nonatomic_guard() noexcept : saved(_atomic_mask & want)
+	{
+		__seiMask(want, Policy::type);
+	}
+
+	~nonatomic_guard() noexcept
+	{
+		__cliMask(Policy::type ? want : saved, Policy::type);
+	}
+
+	nonatomic_guard(const nonatomic_guard &) = delete;
+	nonatomic_guard &operator=(const nonatomic_guard &) = delete;
+};
+
+}	/* namespace util */
+
+#endif
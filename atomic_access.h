@@ -0,0 +1,270 @@
+/* Accessors for variables shared with interrupt handlers.
+
+   On AVR they expand to the usual ATOMIC_BLOCK from avr-libc, on the
+   host they map to the __atomic builtins instead of taking the lock.
+*/
+
+#ifndef _UTIL_ATOMIC_ACCESS_H_
+#define _UTIL_ATOMIC_ACCESS_H_ 1
+
+#if defined(__AVR__)
+#  include <util/atomic.h>
+#else
+#  include "atomic.h"
+#endif
+
+/** \file */
+/** \defgroup util_atomic_access Atomic accessors for ISR shared variables
+    \ingroup util_atomic
+
+    \code
+    #include "atomic_access.h"
+    \endcode
+
+    The documented \c ctr example of <util/atomic.h> only needs the
+    block to read two bytes in one go. With these macros it can be
+    written as
+
+    \code
+   uint16_t ctr_copy;
+   do
+   {
+     ctr_copy = ATOMIC_LOAD16(ctr);
+   }
+   while (ctr_copy != 0);
+    \endcode
+
+    which still is an ATOMIC_BLOCK(ATOMIC_RESTORESTATE) on the target,
+    but a plain (sequentially consistent) load on the host.
+
+    \note On the host, ATOMIC_LOAD() is atomic against any other access,
+    but ATOMIC_STORE() and ATOMIC_FETCH_ADD() are only atomic against
+    other accessors. If an ISR modifies the variable within a block or
+    between isr_enter() and isr_exit() instead, a lock-free store from
+    the main context may get lost. Use them only for variables that are
+    written exclusively through these macros.
+*/
+
+#if defined(__AVR__) && !defined(ATOMIC_READ_BLOCK)
+#define ATOMIC_READ_BLOCK(type) ATOMIC_BLOCK(type)
+#endif
+
+#if defined(__AVR__) && !defined(ATOMIC_BLOCK_BATCH)
+#define ATOMIC_BLOCK_BATCH(sections, type) for ( uint8_t __batchToDo = ((void)(sections), 1); \
+	                                   __batchToDo ; __batchToDo = 0 )
+#endif
+
+#if !defined(__DOXYGEN__)
+#define __ATOMIC_SIZE_CHECK(var, size) ((void)sizeof(char[sizeof(var) == (size) ? 1 : -1]))
+#endif	/* !__DOXYGEN__ */
+
+/** \def ATOMIC_LOAD(var)
+    \ingroup util_atomic_access
+
+    Reads \c var (1, 2, 4 or 8 bytes wide) in one piece.
+*/
+/** \def ATOMIC_STORE(var, val)
+    \ingroup util_atomic_access
+
+    Writes \c val to \c var in one piece.
+*/
+/** \def ATOMIC_FETCH_ADD(var, val)
+    \ingroup util_atomic_access
+
+    Adds \c val to \c var in one piece and returns the previous value.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_LOAD(var)
+#define ATOMIC_STORE(var, val)
+#define ATOMIC_FETCH_ADD(var, val)
+#elif defined(__AVR__)
+/* Single bytes can't tear on an 8-bit CPU. */
+#define ATOMIC_LOAD(var) ({ \
+	__typeof__(var) __load; \
+	if(sizeof(var) == 1) \
+		__load = (var); \
+	else \
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { __load = (var); } \
+	__load; })
+#define ATOMIC_STORE(var, val) do { \
+	__typeof__(var) __store = (val); \
+	if(sizeof(var) == 1) \
+		(var) = __store; \
+	else \
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { (var) = __store; } \
+	} while(0)
+#define ATOMIC_FETCH_ADD(var, val) ({ \
+	__typeof__(var) __old, __add = (val); \
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { __old = (var); (var) = __old + __add; } \
+	__old; })
+#else
+#define ATOMIC_LOAD(var) __atomic_load_n(&(var), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(var, val) __atomic_store_n(&(var), (val), __ATOMIC_SEQ_CST)
+#define ATOMIC_FETCH_ADD(var, val) __atomic_fetch_add(&(var), (val), __ATOMIC_SEQ_CST)
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_LOAD16(var)
+    \ingroup util_atomic_access
+
+    ATOMIC_LOAD() of a variable that has to be 16 bits wide, returned as
+    \c uint16_t.
+*/
+/** \def ATOMIC_LOAD32(var)
+    \ingroup util_atomic_access
+
+    ATOMIC_LOAD() of a variable that has to be 32 bits wide, returned as
+    \c uint32_t.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_LOAD16(var)
+#define ATOMIC_LOAD32(var)
+#else
+#define ATOMIC_LOAD16(var) (__ATOMIC_SIZE_CHECK(var, 2), (uint16_t)ATOMIC_LOAD(var))
+#define ATOMIC_LOAD32(var) (__ATOMIC_SIZE_CHECK(var, 4), (uint32_t)ATOMIC_LOAD(var))
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_SHARED(T)
+    \ingroup util_atomic_access
+
+    Type of a variable of type \c T (e.g. a struct of timestamps) that
+    is shared with an ISR and only accessed through ATOMIC_SHARED_READ()
+    and ATOMIC_SHARED_WRITE(). On the host it carries a sequence count,
+    so readers take a consistent copy without any lock, retrying while a
+    write is in progress; on the target both are an ATOMIC_BLOCK.
+
+    \code
+typedef ATOMIC_SHARED(struct sample) shared_sample_t;
+shared_sample_t last;
+
+ISR(ADC_vect)
+{
+  struct sample s = { ADC, tick };
+  ATOMIC_SHARED_WRITE(last, s);
+}
+
+  struct sample s = ATOMIC_SHARED_READ(last);
+    \endcode
+*/
+/** \def ATOMIC_SHARED_READ(var)
+    \ingroup util_atomic_access
+
+    Returns a consistent copy of the value of the ATOMIC_SHARED() \c var.
+*/
+/** \def ATOMIC_SHARED_WRITE(var, val)
+    \ingroup util_atomic_access
+
+    Sets the value of the ATOMIC_SHARED() \c var to \c val, within an
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE), so writers from several contexts
+    exclude each other. Inside an ISR or atomic block no lock is taken.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_SHARED(T)
+#define ATOMIC_SHARED_READ(var)
+#define ATOMIC_SHARED_WRITE(var, val)
+#elif defined(__AVR__)
+#define ATOMIC_SHARED(T) struct { T __value; }
+#define ATOMIC_SHARED_READ(var) ({ \
+	__typeof__((var).__value) __copy; \
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { __copy = (var).__value; } \
+	__copy; })
+#define ATOMIC_SHARED_WRITE(var, val) do { \
+	__typeof__((var).__value) __store = (val); \
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { (var).__value = __store; } \
+	} while(0)
+#else
+static __inline__ uint32_t __sharedReadBegin(const uint32_t *seq)
+{
+	uint32_t val;
+
+	for(unsigned spins = 0; (val = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1; spins++)
+	{
+		if(spins < ATOMIC_SPIN_COUNT)
+			__cpu_relax();
+		else
+			sched_yield();
+	}
+	return val;
+}
+
+static __inline__ uint8_t __sharedReadRetry(const uint32_t *seq, uint32_t val)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(seq, __ATOMIC_RELAXED) != val;
+}
+
+/* Writers are serialized by the lock, so only the owner bumps seq. */
+static __inline__ void __sharedWriteBegin(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static __inline__ void __sharedWriteEnd(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+#define ATOMIC_SHARED(T) struct { uint32_t __seq; T __value; }
+#define ATOMIC_SHARED_READ(var) ({ \
+	__typeof__((var).__value) __copy; \
+	uint32_t __seq; \
+	do \
+	{ \
+		__seq = __sharedReadBegin(&(var).__seq); \
+		__copy = (var).__value; \
+	} \
+	while(__sharedReadRetry(&(var).__seq, __seq)); \
+	__copy; })
+#define ATOMIC_SHARED_WRITE(var, val) do { \
+	__typeof__((var).__value) __store = (val); \
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) \
+	{ \
+		__sharedWriteBegin(&(var).__seq); \
+		(var).__value = __store; \
+		__sharedWriteEnd(&(var).__seq); \
+	} \
+	} while(0)
+#endif	/* __DOXYGEN__ */
+
+/** \def SHARED_LOAD(var)
+    \ingroup util_atomic_access
+
+    Reads \c var without any protection, the way the target does: with
+    ATOMIC_SIM it is read byte by byte, low byte first, with a
+    sim_point() between the bytes, so the fuzzer can tear the value
+    like an interrupt on an 8-bit CPU would. Otherwise this is a plain
+    read of \c var.
+*/
+/** \def SHARED_STORE(var, val)
+    \ingroup util_atomic_access
+
+    Writes \c val to \c var without any protection, as SHARED_LOAD().
+*/
+#if defined(__DOXYGEN__)
+#define SHARED_LOAD(var)
+#define SHARED_STORE(var, val)
+#elif defined(ATOMIC_SIM) && !defined(__AVR__)
+#define SHARED_LOAD(var) ({ \
+	__typeof__(var) __load; \
+	for(unsigned __i = 0; __i < sizeof(var); __i++) \
+	{ \
+		if(__i) \
+			sim_point(); \
+		((unsigned char *)&__load)[__i] = ((volatile unsigned char *)&(var))[__i]; \
+	} \
+	__load; })
+#define SHARED_STORE(var, val) do { \
+	__typeof__(var) __store = (val); \
+	for(unsigned __i = 0; __i < sizeof(var); __i++) \
+	{ \
+		if(__i) \
+			sim_point(); \
+		((volatile unsigned char *)&(var))[__i] = ((unsigned char *)&__store)[__i]; \
+	} \
+	} while(0)
+#else
+#define SHARED_LOAD(var) (var)
+#define SHARED_STORE(var, val) ((var) = (val))
+#endif	/* __DOXYGEN__ */
+
+#endif
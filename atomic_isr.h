@@ -0,0 +1,407 @@
+/* Timer driven ISR thread pool for the host emulation of <util/atomic.h>.
+
+   Handlers are registered per vector and run on a fixed number of pool
+   threads. A vector raised while interrupts are disabled is latched,
+   and the pool only retries it once some thread enables interrupts
+   again, so no pool thread sleeps on the lock.
+*/
+
+#ifndef _UTIL_ATOMIC_ISR_H_
+#define _UTIL_ATOMIC_ISR_H_ 1
+
+#include "atomic.h"
+
+#include <errno.h>
+#include <time.h>
+
+#if defined(ATOMIC_SIM)
+#  error "atomic_isr.h needs threads, use sim_isr_register() with ATOMIC_SIM"
+#endif
+
+/** \file */
+/** \defgroup util_atomic_isr ISR thread pool
+    \ingroup util_atomic
+
+    \code
+    #include "atomic_isr.h"
+    \endcode
+
+    \code
+static void timer_isr(void)
+{
+  ctr--;
+}
+
+int main(void)
+{
+  isr_pool_register(TIMER1_OVF_vect_num, 0, timer_isr);
+  isr_pool_timer(TIMER1_OVF_vect_num, 100000);    // 10 kHz
+  isr_pool_start(2);
+  ...
+  isr_pool_stop();
+}
+    \endcode
+
+    Pending vectors are run in order of their priority (lower first),
+    then of their vector number, each one on a single pool thread at a
+    time and with interrupts disabled, like isr_enter() / isr_exit()
+    would do. A pool thread that finds interrupts disabled by some
+    other thread leaves the vector latched in isr_pending(); every
+    thread which enables interrupts again wakes the pool.
+
+    The periodic sources are driven by one more thread sleeping until
+    absolute CLOCK_MONOTONIC deadlines, so they don't drift. A source
+    that is due while its vector is still pending loses that tick, as
+    an interrupt flag on the target would; see isr_pool_missed().
+*/
+
+#ifndef ISR_POOL_THREADS
+#  define ISR_POOL_THREADS 16
+#endif
+
+#if !defined(__DOXYGEN__)
+struct _atomic_isr_source_t {
+	void (*handler)(void);
+	uint8_t priority;
+	uint64_t period;
+	uint64_t next;
+	uint64_t missed;
+};
+
+struct _atomic_isr_pool_t {
+	pthread_cond_t work;
+	pthread_cond_t tick;
+	uint64_t raised;
+	uint64_t running;
+	uint64_t timers;
+	uint64_t latched;
+	uint32_t unmasked;
+	uint8_t masked;
+	uint8_t stop;
+	uint8_t timer_started;
+	unsigned threads;
+	pthread_t thread[ISR_POOL_THREADS];
+	pthread_t timer;
+	struct _atomic_isr_source_t source[64];
+};
+
+pthread_mutex_t __attribute__((weak)) _atomic_isr_lock = PTHREAD_MUTEX_INITIALIZER;
+struct _atomic_isr_pool_t __attribute__((weak)) _atomic_isr_pool;
+pthread_once_t __attribute__((weak)) _atomic_isr_once = PTHREAD_ONCE_INIT;
+
+/* The condition variables live as long as the program, isr_pool_raise()
+   may signal them while the pool is stopped or not started yet. */
+static __inline__ void __isrPoolInit(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&_atomic_isr_pool.work, &attr);
+	pthread_cond_init(&_atomic_isr_pool.tick, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static __inline__ uint64_t __isrPoolNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Called with the pool lock held. */
+static __inline__ void __isrPoolRaise(struct _atomic_isr_pool_t *pool, uint8_t vector)
+{
+	uint64_t bit = (uint64_t)1 << vector;
+
+	if(pool->raised & bit)
+		pool->source[vector].missed++;
+	else
+		pool->raised |= bit;
+}
+
+static __inline__ uint8_t __isrPoolPick(const struct _atomic_isr_pool_t *pool, uint64_t ready)
+{
+	uint8_t best = (uint8_t)__builtin_ctzll(ready);
+
+	for(ready &= ready - 1; ready; ready &= ready - 1)
+	{
+		uint8_t vector = (uint8_t)__builtin_ctzll(ready);
+
+		if(pool->source[vector].priority < pool->source[best].priority)
+			best = vector;
+	}
+	return best;
+}
+
+/* _atomic_unmask_hook of the pool. */
+static __inline__ void __isrPoolUnmask(void)
+{
+	struct _atomic_isr_pool_t *pool = &_atomic_isr_pool;
+
+	pthread_mutex_lock(&_atomic_isr_lock);
+	pool->unmasked++;
+	if(pool->masked)
+	{
+		pool->masked = 0;
+		pthread_cond_broadcast(&pool->work);
+	}
+	pthread_mutex_unlock(&_atomic_isr_lock);
+}
+
+static __inline__ void *__isrPoolThread(void *arg)
+{
+	struct _atomic_isr_pool_t *pool = &_atomic_isr_pool;
+
+	(void)arg;
+	pthread_mutex_lock(&_atomic_isr_lock);
+	while(!pool->stop)
+	{
+		uint64_t ready = pool->raised & ~pool->running, bit;
+		uint32_t unmasked;
+		uint8_t vector;
+
+		if(!ready)
+		{
+			pthread_cond_wait(&pool->work, &_atomic_isr_lock);
+			continue;
+		}
+		if(pool->masked)
+		{
+			/* Only a safety net, the unmask hook ends the wait. */
+			struct timespec ts;
+
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_nsec += 10000000;
+			ts.tv_sec += ts.tv_nsec / 1000000000;
+			ts.tv_nsec %= 1000000000;
+			if(pthread_cond_timedwait(&pool->work, &_atomic_isr_lock, &ts) == ETIMEDOUT)
+				pool->masked = 0;
+			continue;
+		}
+
+		vector = __isrPoolPick(pool, ready);
+		bit = (uint64_t)1 << vector;
+		pool->raised &= ~bit;
+		/* Like under ATOMIC_SIM, a vector without a handler is dropped. */
+		if(!pool->source[vector].handler)
+			continue;
+		pool->running |= bit;
+		unmasked = pool->unmasked;
+		pthread_mutex_unlock(&_atomic_isr_lock);
+
+		__atomic_fetch_or(&_atomic_irq.pending, bit, __ATOMIC_SEQ_CST);
+		if(__cliTry())
+		{
+			__atomic_fetch_add(&_atomic_irq.entered, 1, __ATOMIC_RELEASE);
+			__atomic_fetch_and(&_atomic_irq.pending, ~bit, __ATOMIC_RELEASE);
+			_atomic_isr_vector = vector + 1;
+			pool->source[vector].handler();
+			__sei(0);
+			_atomic_isr_vector = 0;
+
+			pthread_mutex_lock(&_atomic_isr_lock);
+			pool->running &= ~bit;
+			pool->latched &= ~bit;
+			if(pool->raised & bit)
+				pthread_cond_signal(&pool->work);
+		}
+		else
+		{
+			/* Stays latched in _atomic_irq.pending until somebody unmasks,
+			   or until isr_pool_stop() if no pool thread is left to retry. */
+			pthread_mutex_lock(&_atomic_isr_lock);
+			pool->running &= ~bit;
+			pool->raised |= bit;
+			pool->latched |= bit;
+			if(unmasked == pool->unmasked)
+				pool->masked = 1;
+		}
+	}
+	pthread_mutex_unlock(&_atomic_isr_lock);
+	return NULL;
+}
+
+static __inline__ void *__isrPoolTimer(void *arg)
+{
+	struct _atomic_isr_pool_t *pool = &_atomic_isr_pool;
+
+	(void)arg;
+	pthread_mutex_lock(&_atomic_isr_lock);
+	while(!pool->stop)
+	{
+		uint64_t now = __isrPoolNow(), next = UINT64_MAX, raised = pool->raised;
+		struct timespec ts;
+
+		for(uint64_t timers = pool->timers; timers; timers &= timers - 1)
+		{
+			uint8_t vector = (uint8_t)__builtin_ctzll(timers);
+			struct _atomic_isr_source_t *source = &pool->source[vector];
+
+			if(source->next <= now)
+			{
+				uint64_t late = (now - source->next) / source->period;
+
+				__isrPoolRaise(pool, vector);
+				source->missed += late;
+				source->next += (late + 1) * source->period;
+			}
+			if(source->next < next)
+				next = source->next;
+		}
+		if(pool->raised != raised)
+			pthread_cond_broadcast(&pool->work);
+		if(next == UINT64_MAX)
+		{
+			pthread_cond_wait(&pool->tick, &_atomic_isr_lock);
+			continue;
+		}
+		ts.tv_sec = (time_t)(next / 1000000000u);
+		ts.tv_nsec = (long)(next % 1000000000u);
+		pthread_cond_timedwait(&pool->tick, &_atomic_isr_lock, &ts);
+	}
+	pthread_mutex_unlock(&_atomic_isr_lock);
+	return NULL;
+}
+#endif	/* !__DOXYGEN__ */
+
+/** \ingroup util_atomic_isr
+
+    Installs \c handler for \c vector (0 .. 63) with \c priority (0 is
+    served first). Has to be called before isr_pool_start().
+*/
+static __inline__ void isr_pool_register(uint8_t vector, uint8_t priority, void (*handler)(void))
+{
+	struct _atomic_isr_pool_t *pool = &_atomic_isr_pool;
+
+	pthread_mutex_lock(&_atomic_isr_lock);
+	pool->source[vector & 63].handler = handler;
+	pool->source[vector & 63].priority = priority;
+	pthread_mutex_unlock(&_atomic_isr_lock);
+}
+
+/** \ingroup util_atomic_isr
+
+    Raises \c vector every \c period_ns nanoseconds once the pool runs,
+    or stops doing so for \c period_ns = 0. Has to be called before
+    isr_pool_start().
+*/
+static __inline__ void isr_pool_timer(uint8_t vector, uint64_t period_ns)
+{
+	struct _atomic_isr_pool_t *pool = &_atomic_isr_pool;
+
+	vector &= 63;
+	pthread_mutex_lock(&_atomic_isr_lock);
+	pool->source[vector].period = period_ns;
+	if(period_ns)
+		pool->timers |= (uint64_t)1 << vector;
+	else
+		pool->timers &= ~((uint64_t)1 << vector);
+	pthread_mutex_unlock(&_atomic_isr_lock);
+}
+
+/** \ingroup util_atomic_isr
+
+    Flags \c vector as pending, e.g. from a simulated UART, like the
+    hardware setting an interrupt flag. May be called from any thread,
+    including handlers.
+*/
+static __inline__ void isr_pool_raise(uint8_t vector)
+{
+	struct _atomic_isr_pool_t *pool = &_atomic_isr_pool;
+
+	pthread_once(&_atomic_isr_once, __isrPoolInit);
+	pthread_mutex_lock(&_atomic_isr_lock);
+	__isrPoolRaise(pool, vector & 63);
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&_atomic_isr_lock);
+}
+
+/** \ingroup util_atomic_isr
+
+    Returns how many raises of \c vector were lost because it was still
+    pending.
+*/
+static __inline__ uint64_t isr_pool_missed(uint8_t vector)
+{
+	struct _atomic_isr_pool_t *pool = &_atomic_isr_pool;
+	uint64_t missed;
+
+	pthread_mutex_lock(&_atomic_isr_lock);
+	missed = pool->source[vector & 63].missed;
+	pthread_mutex_unlock(&_atomic_isr_lock);
+	return missed;
+}
+
+/** \ingroup util_atomic_isr
+
+    Stops the pool, waiting for running handlers to return. Raised
+    vectors that did not run yet stay raised for the next
+    isr_pool_start(), but no longer show in isr_pending().
+*/
+static __inline__ void isr_pool_stop(void)
+{
+	struct _atomic_isr_pool_t *pool = &_atomic_isr_pool;
+
+	pthread_mutex_lock(&_atomic_isr_lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_cond_broadcast(&pool->tick);
+	pthread_mutex_unlock(&_atomic_isr_lock);
+
+	for(unsigned i = 0; i < pool->threads; i++)
+		pthread_join(pool->thread[i], NULL);
+	if(pool->timer_started)
+		pthread_join(pool->timer, NULL);
+	pool->threads = 0;
+	pool->timer_started = 0;
+	__atomic_store_n(&_atomic_unmask_hook, NULL, __ATOMIC_SEQ_CST);
+	__atomic_fetch_and(&_atomic_irq.pending, ~pool->latched, __ATOMIC_RELEASE);
+	pool->latched = 0;
+}
+
+/** \ingroup util_atomic_isr
+
+    Starts \c threads (1 .. ISR_POOL_THREADS) pool threads and the timer
+    thread. Returns 0 on success or an errno value, EBUSY if the pool
+    runs already.
+*/
+static __inline__ int isr_pool_start(unsigned threads)
+{
+	struct _atomic_isr_pool_t *pool = &_atomic_isr_pool;
+	uint64_t now = __isrPoolNow();
+	void (*hook)(void);
+	int err = 0;
+
+	if(!threads || threads > ISR_POOL_THREADS)
+		return EINVAL;
+	if(pool->threads)
+		return EBUSY;
+	pthread_once(&_atomic_isr_once, __isrPoolInit);
+
+	pthread_mutex_lock(&_atomic_isr_lock);
+	pool->stop = 0;
+	pool->masked = 0;
+	for(uint64_t timers = pool->timers; timers; timers &= timers - 1)
+	{
+		struct _atomic_isr_source_t *source = &pool->source[__builtin_ctzll(timers)];
+
+		source->next = now + source->period;
+	}
+	pthread_mutex_unlock(&_atomic_isr_lock);
+
+	hook = __isrPoolUnmask;
+	__atomic_store_n(&_atomic_unmask_hook, hook, __ATOMIC_SEQ_CST);
+	for(pool->threads = 0; pool->threads < threads; pool->threads++)
+		if((err = pthread_create(&pool->thread[pool->threads], NULL, __isrPoolThread, NULL)))
+			break;
+	if(!err)
+		err = pthread_create(&pool->timer, NULL, __isrPoolTimer, NULL);
+	pool->timer_started = !err;
+	if(err)
+		isr_pool_stop();
+	return err;
+}
+
+#endif
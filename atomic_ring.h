@@ -0,0 +1,174 @@
+/* Single producer / single consumer ring buffer for ISR to main loop
+   (or main loop to ISR) transfers.
+
+   On AVR the indices are read and published with the accessors of
+   atomic_access.h, i.e. tiny ATOMIC_BLOCKs, on the host with lock-free
+   acquire/release atomics.
+*/
+
+#ifndef _UTIL_ATOMIC_RING_H_
+#define _UTIL_ATOMIC_RING_H_ 1
+
+#include "atomic_access.h"
+#include <stddef.h>
+
+/** \file */
+/** \defgroup util_atomic_ring Lock-free SPSC ring buffer
+    \ingroup util_atomic
+
+    \code
+    #include "atomic_ring.h"
+    \endcode
+
+    A ring of a power of two number of elements, filled by exactly one
+    context and drained by exactly one other, e.g. a UART receive ISR
+    and the main loop:
+
+    \code
+ATOMIC_RING(uint8_t, 64) rx;
+
+ISR(USART_RX_vect)
+{
+  ATOMIC_RING_PUSH(rx, UDR0);
+}
+
+  uint8_t buf[16];
+  uint16_t n = ATOMIC_RING_POP_N(rx, buf, sizeof(buf));
+    \endcode
+
+    A zero initialized ring is empty. Both indices run freely and are
+    16 bits wide, so a ring holds at most 32768 elements. The batch
+    variants copy as many elements as fit (or are available) and
+    publish the index only once.
+*/
+
+#if !defined(__DOXYGEN__)
+#define __RING_SIZE(ring) (sizeof((ring).__buf) / sizeof((ring).__buf[0]))
+#define __RING_CHECK(ring) ((void)sizeof(char[(__RING_SIZE(ring) & (__RING_SIZE(ring) - 1)) || \
+                                               __RING_SIZE(ring) > 32768 ? -1 : 1]))
+
+#if defined(__AVR__)
+#define __RING_ALIGNED
+/* The owner of an index is the only writer, so it reads it directly. */
+#define __RING_OWN(index) (index)
+#define __RING_ACQUIRE(index) ATOMIC_LOAD(index)
+#define __RING_RELEASE(index, val) ATOMIC_STORE(index, val)
+#else
+/* Producer index, consumer index and the elements in separate lines,
+   so the two sides don't invalidate each other's index. */
+#define __RING_ALIGNED __ATOMIC_ALIGNED
+#define __RING_OWN(index) __atomic_load_n(&(index), __ATOMIC_RELAXED)
+#define __RING_ACQUIRE(index) __atomic_load_n(&(index), __ATOMIC_ACQUIRE)
+#define __RING_RELEASE(index, val) __atomic_store_n(&(index), (val), __ATOMIC_RELEASE)
+#endif	/* __AVR__ */
+#endif	/* !__DOXYGEN__ */
+
+/** \def ATOMIC_RING(T, size)
+    \ingroup util_atomic_ring
+
+    Type of a ring of \c size (a power of two) elements of type \c T.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_RING(T, size)
+#else
+#define ATOMIC_RING(T, size) struct { \
+	uint16_t __head __RING_ALIGNED; \
+	uint16_t __tail __RING_ALIGNED; \
+	T __buf[size] __RING_ALIGNED; }
+#endif	/* __DOXYGEN__ */
+
+/** \def ATOMIC_RING_SIZE(ring)
+    \ingroup util_atomic_ring
+
+    Capacity of \c ring in elements.
+*/
+/** \def ATOMIC_RING_COUNT(ring)
+    \ingroup util_atomic_ring
+
+    Number of elements currently in \c ring. Exact for the consumer and
+    the producer, a lower (consumer) or upper (producer) bound while the
+    other side is active.
+*/
+/** \def ATOMIC_RING_PUSH(ring, val)
+    \ingroup util_atomic_ring
+
+    Appends \c val to \c ring, producer side only. Returns 0 without
+    storing anything if the ring is full, 1 otherwise.
+*/
+/** \def ATOMIC_RING_POP(ring, ptr)
+    \ingroup util_atomic_ring
+
+    Moves the oldest element of \c ring to \c *ptr, consumer side only.
+    Returns 0 if the ring is empty, 1 otherwise.
+*/
+/** \def ATOMIC_RING_PUSH_N(ring, src, n)
+    \ingroup util_atomic_ring
+
+    Appends up to \c n elements from the array \c src to \c ring and
+    returns how many were stored.
+*/
+/** \def ATOMIC_RING_POP_N(ring, dst, n)
+    \ingroup util_atomic_ring
+
+    Moves up to \c n elements from \c ring to the array \c dst and
+    returns how many were moved.
+*/
+#if defined(__DOXYGEN__)
+#define ATOMIC_RING_SIZE(ring)
+#define ATOMIC_RING_COUNT(ring)
+#define ATOMIC_RING_PUSH(ring, val)
+#define ATOMIC_RING_POP(ring, ptr)
+#define ATOMIC_RING_PUSH_N(ring, src, n)
+#define ATOMIC_RING_POP_N(ring, dst, n)
+#else
+#define ATOMIC_RING_SIZE(ring) (__RING_CHECK(ring), (uint16_t)__RING_SIZE(ring))
+
+#define ATOMIC_RING_COUNT(ring) \
+	((uint16_t)(__RING_ACQUIRE((ring).__head) - __RING_ACQUIRE((ring).__tail)))
+
+#define ATOMIC_RING_PUSH(ring, val) ({ \
+	uint16_t __head = __RING_OWN((ring).__head); \
+	uint8_t __ok = (uint16_t)(__head - __RING_ACQUIRE((ring).__tail)) != ATOMIC_RING_SIZE(ring); \
+	if(__ok) \
+	{ \
+		(ring).__buf[__head & (__RING_SIZE(ring) - 1)] = (val); \
+		__RING_RELEASE((ring).__head, (uint16_t)(__head + 1)); \
+	} \
+	__ok; })
+
+#define ATOMIC_RING_POP(ring, ptr) ({ \
+	uint16_t __tail = __RING_OWN((ring).__tail); \
+	uint8_t __ok = __RING_ACQUIRE((ring).__head) != __tail; \
+	if(__ok) \
+	{ \
+		*(ptr) = (ring).__buf[__tail & (__RING_SIZE(ring) - 1)]; \
+		__RING_RELEASE((ring).__tail, (uint16_t)(__tail + 1)); \
+	} \
+	__ok; })
+
+#define ATOMIC_RING_PUSH_N(ring, src, n) ({ \
+	uint16_t __head = __RING_OWN((ring).__head); \
+	uint16_t __free = ATOMIC_RING_SIZE(ring) - (uint16_t)(__head - __RING_ACQUIRE((ring).__tail)); \
+	__typeof__(&(src)[0]) __src = (src); \
+	size_t __want = (n); \
+	uint16_t __n = __want < __free ? (uint16_t)__want : __free; \
+	for(uint16_t __i = 0; __i < __n; __i++) \
+		(ring).__buf[(uint16_t)(__head + __i) & (__RING_SIZE(ring) - 1)] = __src[__i]; \
+	if(__n) \
+		__RING_RELEASE((ring).__head, (uint16_t)(__head + __n)); \
+	__n; })
+
+#define ATOMIC_RING_POP_N(ring, dst, n) ({ \
+	uint16_t __tail = __RING_OWN((ring).__tail); \
+	uint16_t __used = (uint16_t)(__RING_ACQUIRE((ring).__head) - __tail); \
+	__typeof__(&(dst)[0]) __dst = (dst); \
+	size_t __want = (n); \
+	uint16_t __n = __want < __used ? (uint16_t)__want : __used; \
+	for(uint16_t __i = 0; __i < __n; __i++) \
+		__dst[__i] = (ring).__buf[(uint16_t)(__tail + __i) & (__RING_SIZE(ring) - 1)]; \
+	if(__n) \
+		__RING_RELEASE((ring).__tail, (uint16_t)(__tail + __n)); \
+	__n; })
+#endif	/* __DOXYGEN__ */
+
+#endif
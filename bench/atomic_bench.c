@@ -0,0 +1,199 @@
+/* Enter/exit cost of the atomic and non-atomic blocks.
+
+   The main thread runs each block flavour, flat and nested inside an
+   outer ATOMIC_BLOCK, for a fixed time while 0 .. n ISR threads keep
+   interrupting it through isr_enter()/isr_exit(). Build it once per
+   lock backend (see Makefile) to compare them.
+
+   usage: atomic_bench [-t max ISR threads] [-d ms per case] [-g ISR gap ns]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "atomic.h"
+
+#define BENCH_CHUNK 1024
+#define BENCH_NESTED 16
+
+static volatile uint32_t bench_ctr;
+static volatile uint32_t bench_stop;
+static uint64_t bench_isr_runs;
+static uint64_t bench_gap_ns = 1000;
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static uint64_t bench_csw(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (uint64_t)ru.ru_nvcsw + (uint64_t)ru.ru_nivcsw;
+}
+
+static void *bench_isr(void *arg)
+{
+	uint64_t runs = 0;
+
+	ISR_THREAD_REGISTER((uintptr_t)arg);
+	while(!__atomic_load_n(&bench_stop, __ATOMIC_RELAXED))
+	{
+		isr_enter();
+		bench_ctr++;
+		isr_exit();
+		runs++;
+		for(uint64_t until = bench_now() + bench_gap_ns; bench_now() < until; )
+			__cpu_relax();
+	}
+	__atomic_fetch_add(&bench_isr_runs, runs, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* Each case runs BENCH_CHUNK operations per call. Nested cases enter
+   the outer block once per BENCH_NESTED operations, so they mostly
+   measure the inner block. */
+static void bench_atomic_forceon(void)
+{
+	for(int i = 0; i < BENCH_CHUNK; i++)
+		ATOMIC_BLOCK(ATOMIC_FORCEON) { bench_ctr++; }
+}
+
+static void bench_atomic_restorestate(void)
+{
+	for(int i = 0; i < BENCH_CHUNK; i++)
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { bench_ctr++; }
+}
+
+static void bench_atomic_restorestate_nested(void)
+{
+	for(int i = 0; i < BENCH_CHUNK; i += BENCH_NESTED)
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			for(int j = 0; j < BENCH_NESTED; j++)
+				ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { bench_ctr++; }
+}
+
+static void bench_nonatomic_restorestate(void)
+{
+	for(int i = 0; i < BENCH_CHUNK; i++)
+		NONATOMIC_BLOCK(NONATOMIC_RESTORESTATE) { bench_ctr++; }
+}
+
+static void bench_nonatomic_restorestate_nested(void)
+{
+	for(int i = 0; i < BENCH_CHUNK; i += BENCH_NESTED)
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			for(int j = 0; j < BENCH_NESTED; j++)
+				NONATOMIC_BLOCK(NONATOMIC_RESTORESTATE) { bench_ctr++; }
+}
+
+static void bench_nonatomic_forceoff_nested(void)
+{
+	for(int i = 0; i < BENCH_CHUNK; i += BENCH_NESTED)
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			for(int j = 0; j < BENCH_NESTED; j++)
+				NONATOMIC_BLOCK(NONATOMIC_FORCEOFF) { bench_ctr++; }
+}
+
+/* ATOMIC_FORCEON nested and NONATOMIC_FORCEOFF flat are misuse (they
+   leave the interrupt state changed) and not measured. */
+static const struct
+{
+	const char *name;
+	void (*run)(void);
+} bench_cases[] = {
+	{ "ATOMIC_FORCEON", bench_atomic_forceon },
+	{ "ATOMIC_RESTORESTATE", bench_atomic_restorestate },
+	{ "ATOMIC_RESTORESTATE nested", bench_atomic_restorestate_nested },
+	{ "NONATOMIC_RESTORESTATE", bench_nonatomic_restorestate },
+	{ "NONATOMIC_RESTORESTATE nested", bench_nonatomic_restorestate_nested },
+	{ "NONATOMIC_FORCEOFF nested", bench_nonatomic_forceoff_nested },
+};
+
+static void *bench_idle(void *arg)
+{
+	return arg;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned max_isr = 4, duration_ms = 200;
+	pthread_t idle;
+	int opt;
+
+	while((opt = getopt(argc, argv, "t:d:g:")) != -1)
+	{
+		switch(opt)
+		{
+		case 't': max_isr = (unsigned)atoi(optarg); break;
+		case 'd': duration_ms = (unsigned)atoi(optarg); break;
+		case 'g': bench_gap_ns = (uint64_t)atoll(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-t max ISR threads] [-d ms per case] [-g ISR gap ns]\n", argv[0]);
+			return 2;
+		}
+	}
+	if(max_isr > 64)
+		max_isr = 64;
+
+	/* glibc skips the atomic instructions of an uncontended mutex until
+	   the process has started a second thread, that would flatter the
+	   runs without ISR threads. */
+	pthread_create(&idle, NULL, bench_idle, NULL);
+	pthread_join(idle, NULL);
+
+#if defined(ATOMIC_LOCK_FUTEX)
+	printf("backend futex");
+#else
+	printf("backend pthread_mutex");
+#endif
+#if defined(ATOMIC_SPIN_ADAPTIVE)
+	printf(" adaptive spin");
+#endif
+	printf(", %d domain(s), %u ms per case, ISR gap %llu ns\n", ATOMIC_DOMAINS, duration_ms,
+	       (unsigned long long)bench_gap_ns);
+	printf("%-32s %4s %10s %12s %12s %10s\n", "case", "isrs", "ns/op", "ops/s", "isr runs/s", "csw/s");
+
+	for(unsigned c = 0; c < sizeof(bench_cases) / sizeof(bench_cases[0]); c++)
+	{
+		for(unsigned isrs = 0; isrs <= max_isr; isrs++)
+		{
+			pthread_t threads[64];
+			uint64_t ops = 0, start, elapsed, until, csw;
+
+			bench_stop = 0;
+			bench_isr_runs = 0;
+			for(unsigned i = 0; i < isrs; i++)
+				pthread_create(&threads[i], NULL, bench_isr, (void *)(uintptr_t)i);
+
+			csw = bench_csw();
+			start = bench_now();
+			until = start + (uint64_t)duration_ms * 1000000u;
+			do
+			{
+				bench_cases[c].run();
+				ops += BENCH_CHUNK;
+			}
+			while(bench_now() < until);
+			elapsed = bench_now() - start;
+			csw = bench_csw() - csw;
+
+			__atomic_store_n(&bench_stop, 1, __ATOMIC_RELAXED);
+			for(unsigned i = 0; i < isrs; i++)
+				pthread_join(threads[i], NULL);
+
+			printf("%-32s %4u %10.1f %12.0f %12.0f %10.0f\n", bench_cases[c].name, isrs,
+			       (double)elapsed / ops, ops * 1e9 / elapsed, bench_isr_runs * 1e9 / elapsed,
+			       csw * 1e9 / elapsed);
+		}
+	}
+	return 0;
+}
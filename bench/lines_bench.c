@@ -0,0 +1,99 @@
+/* Cost of false sharing between lock domains.
+
+   Every thread runs ATOMIC_BLOCK_DOMAIN() on a domain of its own and
+   increments a counter of its own, so the threads share no data at all
+   and only the placement of the lock state decides whether they slow
+   each other down. Built once with the default ATOMIC_CACHE_LINE and
+   once with ATOMIC_CACHE_LINE=8, which packs the domains together like
+   plain arrays would (see Makefile).
+
+   usage: lines_bench [-t max threads] [-d ms per case]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "atomic.h"
+
+#define BENCH_CHUNK 1024
+
+struct bench_thread {
+	pthread_t thread;
+	uint8_t domain;
+	uint64_t ops;
+} __attribute__((aligned(128)));
+
+static volatile uint32_t bench_stop;
+
+static void *bench_run(void *arg)
+{
+	struct bench_thread *self = (struct bench_thread *)arg;
+	uint64_t ops = 0;
+
+	while(!__atomic_load_n(&bench_stop, __ATOMIC_RELAXED))
+	{
+		for(int i = 0; i < BENCH_CHUNK; i++)
+			ATOMIC_BLOCK_DOMAIN(self->domain, ATOMIC_RESTORESTATE) { ops++; }
+	}
+	self->ops = ops;
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned max_threads = ATOMIC_DOMAINS, duration_ms = 200;
+	int opt;
+
+	while((opt = getopt(argc, argv, "t:d:")) != -1)
+	{
+		switch(opt)
+		{
+		case 't': max_threads = (unsigned)atoi(optarg); break;
+		case 'd': duration_ms = (unsigned)atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-t max threads] [-d ms per case]\n", argv[0]);
+			return 2;
+		}
+	}
+	if(max_threads > ATOMIC_DOMAINS)
+		max_threads = ATOMIC_DOMAINS;
+
+	printf("%s, %d domain(s) of %zu bytes, %u ms per case\n",
+#if defined(ATOMIC_LOCK_FUTEX)
+	       "backend futex",
+#else
+	       "backend pthread_mutex",
+#endif
+	       ATOMIC_DOMAINS, sizeof(struct _atomic_lock_t), duration_ms);
+	printf("%7s %10s %12s\n", "threads", "ns/op", "ops/s");
+
+	for(unsigned threads = 1; threads <= max_threads; threads++)
+	{
+		struct bench_thread bench[ATOMIC_DOMAINS];
+		struct timespec ts = { 0, 0 };
+		uint64_t ops = 0;
+
+		bench_stop = 0;
+		for(unsigned i = 0; i < threads; i++)
+		{
+			bench[i].domain = (uint8_t)i;
+			pthread_create(&bench[i].thread, NULL, bench_run, &bench[i]);
+		}
+		ts.tv_sec = duration_ms / 1000;
+		ts.tv_nsec = (long)(duration_ms % 1000) * 1000000;
+		nanosleep(&ts, NULL);
+		__atomic_store_n(&bench_stop, 1, __ATOMIC_RELAXED);
+		for(unsigned i = 0; i < threads; i++)
+		{
+			pthread_join(bench[i].thread, NULL);
+			ops += bench[i].ops;
+		}
+
+		/* ns/op per thread, i.e. what a single block costs each of them */
+		printf("%7u %10.1f %12.0f\n", threads, duration_ms * 1e6 * threads / ops,
+		       ops * 1e3 / duration_ms);
+	}
+	return 0;
+}